@@ -21,7 +21,7 @@ int main(/*int argc, char ** argv*/) {
     exit(EXIT_FAILURE);
 
   if (bindSocket(&socketInfo, PORT) != 0) {
-    close(socketInfo.socketFD);
+    closeSocket(&socketInfo);
     exit(EXIT_FAILURE);
   }
 
@@ -55,17 +55,19 @@ void onHandshake(WSConnection const * const client) {
 }
 
 size_t onMessage(WSConnection const * const client, char const * const incData, char ** outData) {
-  (void)client;
   (void)incData;
+  (void)outData;
   char testString[] = 
     "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Donec fringilla ligula ut magna congue dapibus. "
     "Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia curae; "
     "Integer et consectetur mi. Nam feugiat, eros fringilla feugiat hendrerit, elit velit.";
   size_t size = strlen(testString);
-  char * data = realloc(*outData, size + 1);
-  strcpy(data, testString);
-  *outData = data;
-  return size + 1;
+  char * reply = getReplyBuffer(client, size);
+  if (reply == NULL)
+    return 0;
+  memcpy(reply, testString, size);
+  commitReply(client, size);
+  return 0;
 }
 
 void onDisconnect(WSConnection const * const client) {
@@ -0,0 +1,530 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "hashmap.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "21455"
+#define HANDSHAKE_TIMEOUT_S 5
+#define UPGRADE_CHECK_MS 100
+#define DRAIN_BUFFER (64 * 1024)
+#define EVENTS_PER_WAIT 64
+
+// Build with: cc examples/replay.c src/capture.c src/hashmap.c -Iinclude -lpthread -O2
+// Usage: replay <capture file> [host] [port] [speed], speed 1 plays at the captured pace, 0 as fast as possible
+
+typedef struct {
+  CaptureRecord record;
+  uint8_t * data;
+  size_t sequence; // Position in the file, keeps records with the same timestamp in file order
+} ReplayRecord;
+
+typedef enum {
+  REPLAY_CONNECTING = 0, // Waiting on the connect, then on room for the upgrade request
+  REPLAY_UPGRADING,      // Request sent, waiting for the server to switch protocols
+  REPLAY_OPEN,
+  REPLAY_FAILED          // Refused or timed out here, the rest of its records are dropped
+} ReplayState;
+
+//One captured connection. Frames sent before the answer to the upgrade would be read together with the request,
+//so the ones due before it wait in early
+typedef struct {
+  int32_t fd;
+  uint32_t id;
+  uint8_t state;
+  uint8_t isClosed;         // Its close came while it was still upgrading
+  uint64_t deadline;        // For the answer to the upgrade
+  ReplayRecord const * request;
+  size_t requestSent;
+  char response[1024];
+  size_t responseLength;
+  ReplayRecord const ** early;
+  uint32_t earlyCount;
+  uint32_t earlyCapacity;
+  uint32_t upgradingIndex;  // Slot in upgrading until the upgrade is settled
+} ReplayConnection;
+
+typedef struct {
+  uint64_t connections;
+  uint64_t refused;
+  uint64_t skipped;
+  uint64_t frames;
+  uint64_t bytesSent;
+  uint64_t bytesReceived;
+  uint64_t maxLagMicros;
+} ReplayStats;
+
+static struct addrinfo * target;
+static int32_t eventPoll;
+static Map connections; // Capture id to ReplayConnection *
+static ReplayConnection ** upgrading;
+static uint32_t upgradingCount;
+static uint32_t upgradingCapacity;
+static ReplayStats stats;
+static uint8_t drainBuffer[DRAIN_BUFFER];
+
+static uint64_t monotonicMicros(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int8_t compareIDs(void const * id1, void const * id2) {
+  // Keys are packed without padding in the map's entries
+  return memcmp(id1, id2, sizeof(uint32_t)) == 0;
+}
+
+static int compareRecords(void const * record1, void const * record2) {
+  ReplayRecord const * const first = record1;
+  ReplayRecord const * const second = record2;
+  if (first->record.micros != second->record.micros)
+    return (first->record.micros < second->record.micros) ? -1 : 1;
+  return (first->sequence < second->sequence) ? -1 : (first->sequence > second->sequence);
+}
+
+// Cluster processes append whole buffers to the same file, so it is only in order per process. Returns 0 on success,
+// -1 if the file could not be read at all (a damaged tail only stops the load early)
+static int8_t loadRecords(FILE * file, ReplayRecord ** records, size_t * count) {
+  size_t capacity = 0;
+  *records = NULL;
+  *count = 0;
+
+  for (;;) {
+    if (*count == capacity) {
+      size_t const newCapacity = (capacity == 0) ? 1024 : capacity << 1;
+      ReplayRecord * const grown = realloc(*records, newCapacity * sizeof(ReplayRecord));
+      if (grown == NULL)
+        return -1;
+      *records = grown;
+      capacity = newCapacity;
+    }
+
+    ReplayRecord * const next = &((*records)[*count]);
+    size_t dataCapacity = 0;
+    next->data = NULL;
+    int8_t const result = readCaptureRecord(file, &(next->record), &(next->data), &dataCapacity);
+    if (result != 1) {
+      free(next->data);
+      if (result == -1)
+        printf("(Replay): Capture file is damaged, only replaying what came before\n");
+      break;
+    }
+    next->sequence = (*count)++;
+  }
+
+  // CLOCK_MONOTONIC is shared by every process on the machine, so timestamps put the whole file back in order
+  qsort(*records, *count, sizeof(ReplayRecord), compareRecords);
+  return 0;
+}
+
+static void drainSocket(ReplayConnection * const connection) {
+  for (;;) {
+    ssize_t received = recv(connection->fd, drainBuffer, DRAIN_BUFFER, MSG_DONTWAIT);
+    if (received > 0) {
+      stats.bytesReceived += received;
+      continue;
+    }
+    if (received == 0)
+      epoll_ctl(eventPoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    return;
+  }
+}
+
+static int8_t sendAll(int32_t fd, uint8_t const * data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return 0;
+}
+
+static int8_t replayFrame(int32_t fd, uint8_t opcode, uint8_t const * payload, uint32_t length) {
+  uint8_t header[14];
+  uint8_t headerLength = 2;
+  header[0] = 0x80 | opcode;
+  if (length <= 125) {
+    header[1] = 0x80 | length;
+  } else if (length <= 65535) {
+    header[1] = 0x80 | 126;
+    header[2] = (length >> 8) & 0xFF;
+    header[3] = length & 0xFF;
+    headerLength = 4;
+  } else {
+    header[1] = 0x80 | 127;
+    for (uint8_t i = 0; i < 8; i++)
+      header[2 + i] = ((uint64_t)length >> (56 - 8 * i)) & 0xFF;
+    headerLength = 10;
+  }
+
+  uint8_t * const mask = header + headerLength;
+  uint32_t const maskBits = (uint32_t)rand();
+  memcpy(mask, &maskBits, 4);
+  headerLength += 4;
+
+  uint8_t * const frame = malloc(headerLength + (size_t)length);
+  if (frame == NULL)
+    return -1;
+  memcpy(frame, header, headerLength);
+  for (uint32_t i = 0; i < length; i++)
+    frame[headerLength + i] = payload[i] ^ mask[i % 4];
+
+  int8_t const result = sendAll(fd, frame, headerLength + (size_t)length);
+  free(frame);
+  stats.bytesSent += headerLength + (size_t)length;
+  return result;
+}
+
+static int8_t trackUpgrade(ReplayConnection * const connection) {
+  if (upgradingCount == upgradingCapacity) {
+    uint32_t const newCapacity = (upgradingCapacity == 0) ? 64 : upgradingCapacity << 1;
+    ReplayConnection ** const grown = realloc(upgrading, newCapacity * sizeof(ReplayConnection *));
+    if (grown == NULL)
+      return -1;
+    upgrading = grown;
+    upgradingCapacity = newCapacity;
+  }
+
+  connection->upgradingIndex = upgradingCount;
+  upgrading[upgradingCount++] = connection;
+  return 0;
+}
+
+static void untrackUpgrade(ReplayConnection * const connection) {
+  ReplayConnection * const last = upgrading[--upgradingCount];
+  upgrading[connection->upgradingIndex] = last;
+  last->upgradingIndex = connection->upgradingIndex;
+}
+
+// Values are packed right behind their key, a pointer is copied out rather than loaded in place
+static ReplayConnection * findConnection(uint32_t id) {
+  void const * const value = mapGet(&connections, &id);
+  if (value == NULL)
+    return NULL;
+
+  ReplayConnection * connection;
+  memcpy(&connection, value, sizeof(connection));
+  return connection;
+}
+
+static void forgetConnection(ReplayConnection * connection) {
+  mapRemove(&connections, &(connection->id));
+  free(connection->early);
+  free(connection);
+}
+
+static void closeConnection(ReplayConnection * const connection) {
+  if (connection->state == REPLAY_OPEN) {
+    replayFrame(connection->fd, 0x08, (uint8_t const *)"\x03\xe8", 2);
+    close(connection->fd);
+  }
+  forgetConnection(connection);
+}
+
+static void failUpgrade(ReplayConnection * const connection) {
+  stats.refused++;
+  untrackUpgrade(connection);
+  if (connection->fd != -1)
+    close(connection->fd);
+  connection->fd = -1;
+  connection->state = REPLAY_FAILED;
+  free(connection->early);
+  connection->early = NULL;
+  connection->earlyCount = 0;
+
+  if (connection->isClosed)
+    forgetConnection(connection);
+}
+
+static void openConnection(ReplayConnection * const connection) {
+  untrackUpgrade(connection);
+  connection->state = REPLAY_OPEN;
+  // Frames go out with plain blocking sends from here on, only reads are drained without blocking
+  fcntl(connection->fd, F_SETFL, fcntl(connection->fd, F_GETFL) & ~O_NONBLOCK);
+
+  for (uint32_t i = 0; i < connection->earlyCount; i++) {
+    ReplayRecord const * const early = connection->early[i];
+    if (replayFrame(connection->fd, early->record.opcode, early->data, early->record.length) == 0)
+      stats.frames++;
+  }
+  free(connection->early);
+  connection->early = NULL;
+  connection->earlyCount = 0;
+
+  if (connection->isClosed)
+    closeConnection(connection);
+}
+
+// Takes a connection through its upgrade as far as the socket allows without blocking
+static void advanceUpgrade(ReplayConnection * const connection) {
+  if (connection->state == REPLAY_CONNECTING) {
+    int32_t error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) == -1 || error != 0)
+      goto failed;
+
+    ReplayRecord const * const request = connection->request;
+    while (connection->requestSent < request->record.length) {
+      ssize_t const sent = send(connection->fd, request->data + connection->requestSent, request->record.length - connection->requestSent, MSG_NOSIGNAL);
+      if (sent == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return;
+        goto failed;
+      }
+      connection->requestSent += sent;
+      stats.bytesSent += sent;
+    }
+
+    connection->state = REPLAY_UPGRADING;
+    struct epoll_event event = {
+      .data.ptr = connection,
+      .events = EPOLLIN
+    };
+    epoll_ctl(eventPoll, EPOLL_CTL_MOD, connection->fd, &event);
+    return;
+  }
+
+  for (;;) {
+    ssize_t const received = recv(connection->fd, connection->response + connection->responseLength,
+        sizeof(connection->response) - 1 - connection->responseLength, 0);
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (received <= 0)
+      goto failed;
+    stats.bytesReceived += received;
+    connection->responseLength += received;
+    connection->response[connection->responseLength] = '\0';
+    if (strstr(connection->response, "\r\n\r\n") != NULL)
+      break;
+    if (connection->responseLength == sizeof(connection->response) - 1)
+      goto failed;
+  }
+  if (strncmp(connection->response, "HTTP/1.1 101", 12) != 0)
+    goto failed;
+
+  openConnection(connection);
+  return;
+
+  failed:
+    failUpgrade(connection);
+}
+
+static void startConnection(ReplayRecord const * const request) {
+  stats.connections++;
+  ReplayConnection * connection = calloc(1, sizeof(ReplayConnection));
+  if (connection == NULL) {
+    stats.refused++;
+    return;
+  }
+  connection->fd = -1;
+  connection->id = request->record.connection;
+  connection->request = request;
+  connection->deadline = monotonicMicros() + HANDSHAKE_TIMEOUT_S * 1000000ull;
+  mapPut(&connections, &(connection->id), &connection);
+  if (trackUpgrade(connection) == -1) {
+    stats.refused++;
+    forgetConnection(connection);
+    return;
+  }
+
+  if ((connection->fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+      || (connect(connection->fd, target->ai_addr, target->ai_addrlen) == -1 && errno != EINPROGRESS)) {
+    failUpgrade(connection);
+    return;
+  }
+
+  // Writable once connected, whether that already happened or not
+  struct epoll_event event = {
+    .data.ptr = connection,
+    .events = EPOLLOUT
+  };
+  if (epoll_ctl(eventPoll, EPOLL_CTL_ADD, connection->fd, &event) == -1)
+    failUpgrade(connection);
+}
+
+static void holdEarlyFrame(ReplayConnection * const connection, ReplayRecord const * const frame) {
+  if (connection->earlyCount == connection->earlyCapacity) {
+    uint32_t const newCapacity = (connection->earlyCapacity == 0) ? 8 : connection->earlyCapacity << 1;
+    ReplayRecord const ** const grown = realloc(connection->early, newCapacity * sizeof(ReplayRecord const *));
+    if (grown == NULL)
+      return;
+    connection->early = grown;
+    connection->earlyCapacity = newCapacity;
+  }
+  connection->early[connection->earlyCount++] = frame;
+}
+
+static void expireUpgrades(void) {
+  uint64_t const now = monotonicMicros();
+  for (uint32_t i = 0; i < upgradingCount;) {
+    if (upgrading[i]->deadline > now)
+      i++;
+    else
+      failUpgrade(upgrading[i]); // The last one moves into i
+  }
+}
+
+// Keeps reading what the server sends and moving upgrades along until due, so replies never back up into the server's queues
+static void waitUntil(uint64_t due) {
+  struct epoll_event events[EVENTS_PER_WAIT];
+  for (;;) {
+    uint64_t const now = monotonicMicros();
+    int32_t timeout = (now >= due) ? 0 : (int32_t)((due - now + 999) / 1000);
+    // Upgrades that never get an answer are given up on, without waiting for the next record
+    if (upgradingCount > 0 && timeout > UPGRADE_CHECK_MS)
+      timeout = UPGRADE_CHECK_MS;
+    int32_t const count = epoll_wait(eventPoll, events, EVENTS_PER_WAIT, timeout);
+    for (int32_t i = 0; i < count; i++) {
+      ReplayConnection * const connection = events[i].data.ptr;
+      if (connection->state == REPLAY_OPEN)
+        drainSocket(connection);
+      else
+        advanceUpgrade(connection);
+    }
+    expireUpgrades();
+    if (monotonicMicros() >= due && count < EVENTS_PER_WAIT)
+      return;
+  }
+}
+
+// Upgrades the server turned down in the capture would only be turned down again, their close carries the HTTP status
+static void findRefused(ReplayRecord const * const records, size_t const count, Map * const refused) {
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].record.type != CAPTURE_CLOSE || records[i].record.length != sizeof(uint16_t))
+      continue;
+    uint16_t status;
+    memcpy(&status, records[i].data, sizeof(status));
+    if (status < 1000) {
+      uint32_t id = records[i].record.connection;
+      mapPut(refused, &id, &status);
+    }
+  }
+}
+
+static void closeRemaining(void * idPtr, void * connectionPtr, void * contextPtr) {
+  (void)idPtr; //unused
+  (void)contextPtr; //unused
+
+  ReplayConnection * connection;
+  memcpy(&connection, connectionPtr, sizeof(connection));
+  if (connection->fd != -1)
+    close(connection->fd);
+  free(connection->early);
+  free(connection);
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 2) {
+    printf("Usage: %s <capture file> [host] [port] [speed]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  char const * const host = (argc > 2) ? argv[2] : DEFAULT_HOST;
+  char const * const port = (argc > 3) ? argv[3] : DEFAULT_PORT;
+  double const speed = (argc > 4) ? atof(argv[4]) : 1.0;
+
+  FILE * file = fopen(argv[1], "rb");
+  if (file == NULL || openCaptureFile(file) == -1) {
+    printf("(Replay): \"%s\" is not a capture file\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+  if (getaddrinfo(host, port, &hints, &target) != 0) {
+    printf("(Replay): Could not resolve %s:%s\n", host, port);
+    return EXIT_FAILURE;
+  }
+  if ((eventPoll = epoll_create1(0)) == -1)
+    return EXIT_FAILURE;
+
+  ReplayRecord * records;
+  size_t recordCount;
+  if (loadRecords(file, &records, &recordCount) == -1) {
+    printf("(Replay): Could not load \"%s\"\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  Map refused;
+  initMap(&refused, sizeof(uint32_t), sizeof(uint16_t), compareIDs, NULL);
+  findRefused(records, recordCount, &refused);
+  initMap(&connections, sizeof(uint32_t), sizeof(ReplayConnection *), compareIDs, NULL);
+
+  uint64_t const firstMicros = (recordCount > 0) ? records[0].record.micros : 0;
+  uint64_t const lastMicros = (recordCount > 0) ? records[recordCount - 1].record.micros : 0;
+  uint64_t const start = monotonicMicros();
+  for (size_t i = 0; i < recordCount; i++) {
+    CaptureRecord record = records[i].record;
+    uint8_t const * const data = records[i].data;
+
+    uint64_t const offset = record.micros - firstMicros;
+    uint64_t const due = start + ((speed > 0) ? (uint64_t)(offset / speed) : 0);
+    waitUntil(due);
+    uint64_t const now = monotonicMicros();
+    if (now > due && now - due > stats.maxLagMicros)
+      stats.maxLagMicros = now - due;
+
+    ReplayConnection * const known = findConnection(record.connection);
+    switch (record.type) {
+      case CAPTURE_HANDSHAKE:
+        if (mapGet(&refused, &(record.connection)) != NULL)
+          stats.skipped++;
+        else
+          startConnection(&(records[i]));
+        break;
+      case CAPTURE_FRAME:
+        if (known == NULL)
+          break;
+        if (known->state == REPLAY_OPEN && replayFrame(known->fd, record.opcode, data, record.length) == 0)
+          stats.frames++;
+        else if (known->state == REPLAY_CONNECTING || known->state == REPLAY_UPGRADING)
+          holdEarlyFrame(known, &(records[i]));
+        break;
+      case CAPTURE_CLOSE:
+        if (known == NULL)
+          break;
+        if (known->state == REPLAY_CONNECTING || known->state == REPLAY_UPGRADING)
+          known->isClosed = 1;
+        else
+          closeConnection(known);
+        break;
+    }
+  }
+  // Give the last replies a moment to arrive, and the last upgrades their answer
+  do
+    waitUntil(monotonicMicros() + 200000);
+  while (upgradingCount > 0);
+  double const elapsed = (monotonicMicros() - start) / 1e6;
+
+  mapForEach(&connections, NULL, closeRemaining);
+  freeMap(&connections);
+  freeMap(&refused);
+  free(upgrading);
+  for (size_t i = 0; i < recordCount; i++)
+    free(records[i].data);
+  free(records);
+  freeaddrinfo(target);
+  close(eventPoll);
+  fclose(file);
+
+  printf("(Replay): %.2fs captured, replayed in %.2fs\n", (lastMicros - firstMicros) / 1e6, elapsed);
+  printf("(Replay): %lu connections (%lu refused, %lu skipped as refused in the capture), %lu frames, %lu bytes sent, %lu bytes received\n",
+      (unsigned long)stats.connections, (unsigned long)stats.refused, (unsigned long)stats.skipped, (unsigned long)stats.frames,
+      (unsigned long)stats.bytesSent, (unsigned long)stats.bytesReceived);
+  printf("(Replay): fell up to %.2fms behind schedule\n", stats.maxLagMicros / 1e3);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utf8.h"
+
+#define CORPUS_SIZE (64 * 1024 * 1024)
+#define ROUNDS 10
+
+// Build with: cc examples/utf8_bench.c src/utf8.c -Iinclude -O2
+
+static double seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void fillASCII(uint8_t * corpus, size_t size) {
+  char const text[] = "{\"type\":\"tick\",\"symbol\":\"ABC\",\"price\":123.45,\"size\":100} ";
+  for (size_t i = 0; i < size; i++)
+    corpus[i] = text[i % (sizeof(text) - 1)];
+}
+
+// Mostly non-Latin text: a mix of 1, 2, 3 and 4 byte sequences
+static void fillMultibyte(uint8_t * corpus, size_t size) {
+  char const * const samples[] = {"a", "\xC3\xA9", "\xD0\x96", "\xE4\xB8\xAD", "\xE6\x97\xA5", "\xF0\x9F\x98\x80", " "};
+  size_t const sampleCount = sizeof(samples) / sizeof(samples[0]);
+  size_t i = 0;
+  uint32_t seed = 12345;
+  for (;;) {
+    seed = seed * 1103515245 + 12345;
+    char const * sample = samples[(seed >> 16) % sampleCount];
+    size_t const length = strlen(sample);
+    if (i + length > size)
+      break;
+    memcpy(corpus + i, sample, length);
+    i += length;
+  }
+  memset(corpus + i, ' ', size - i);
+}
+
+static void run(char const * name, uint8_t (*validate)(uint8_t const *, size_t), uint8_t const * corpus, size_t size) {
+  double const start = seconds();
+  uint32_t valid = 0;
+  for (uint32_t i = 0; i < ROUNDS; i++)
+    valid += validate(corpus, size);
+  double const elapsed = seconds() - start;
+
+  printf("  %-8s %8.1f MB/s%s\n", name, (double)size * ROUNDS / elapsed / 1e6, (valid == ROUNDS) ? "" : " (REJECTED)");
+}
+
+int main(void) {
+  uint8_t * corpus = malloc(CORPUS_SIZE);
+  if (corpus == NULL)
+    return EXIT_FAILURE;
+
+  fillASCII(corpus, CORPUS_SIZE);
+  printf("ASCII corpus (%d MB):\n", CORPUS_SIZE >> 20);
+  run("scalar", utf8ValidateScalar, corpus, CORPUS_SIZE);
+  run("simd", utf8Validate, corpus, CORPUS_SIZE);
+
+  fillMultibyte(corpus, CORPUS_SIZE);
+  printf("Multibyte corpus (%d MB):\n", CORPUS_SIZE >> 20);
+  run("scalar", utf8ValidateScalar, corpus, CORPUS_SIZE);
+  run("simd", utf8Validate, corpus, CORPUS_SIZE);
+
+  free(corpus);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADMISSION_ADDRESS_SIZE 16
+
+typedef struct {
+  uint8_t address[ADMISSION_ADDRESS_SIZE]; // IPv4 is stored IPv4-mapped (::ffff:a.b.c.d)
+  uint64_t lastSeen;
+  double tokens;
+} AdmissionBucket;
+
+//Fixed size table of per address token buckets. Buckets idle long enough to be full again are reused
+//in place, so the table never grows and never needs a separate sweep
+typedef struct {
+  AdmissionBucket * buckets;
+  uint32_t capacity;
+  double ratePerSecond;
+  double burst;
+  uint64_t refillMicros;
+} AdmissionTable;
+
+// Returns 0 on success, -1 otherwise. capacity is rounded up to a power of two
+int8_t initAdmissionTable(AdmissionTable * table, uint32_t capacity, double ratePerSecond, double burst);
+void freeAdmissionTable(AdmissionTable * table);
+
+// Returns 1 and takes a token if the address may connect, 0 otherwise
+uint8_t admissionTake(AdmissionTable * table, uint8_t const address[ADMISSION_ADDRESS_SIZE], uint64_t nowMicros);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaChunk ArenaChunk;
+
+struct ArenaChunk {
+  ArenaChunk * next;
+  size_t capacity;
+  size_t used;
+  _Alignas(ARENA_ALIGNMENT) unsigned char data[];
+};
+
+//Bump allocator, everything it hands out is released at once by arenaReset or freeArena
+typedef struct {
+  ArenaChunk * chunks;
+  size_t chunkSize;
+  size_t allocated; // Bytes currently held from malloc, chunk headers included
+} Arena;
+
+void initArena(Arena * arena, size_t chunkSize);
+//Returns NULL if out of memory, memory is aligned to ARENA_ALIGNMENT and not zeroed
+void * arenaAlloc(Arena * arena, size_t size);
+//Invalidates every allocation but keeps one regular sized chunk around for reuse
+void arenaReset(Arena * arena);
+void freeArena(Arena * arena);
+
+#endif
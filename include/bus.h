@@ -0,0 +1,49 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define BUS_MAX_PROCESSES 32
+
+//First page of the shared mapping, the ring itself follows it
+typedef struct {
+  atomic_uint_fast64_t reserved; // Absolute offset of the next free byte, producers claim space by adding to it
+  atomic_uint wakePending[BUS_MAX_PROCESSES];
+  uint64_t secret;
+} BusHeader;
+
+//Broadcast ring shared by forked processes. Every process reads every record from its own cursor, a reader that
+//falls a full ring behind skips ahead and loses what it missed instead of holding producers back
+typedef struct {
+  BusHeader * header;
+  uint8_t * ring;
+  uint64_t capacity;
+  uint64_t readCursor;
+  uint8_t processCount;
+  uint8_t processIndex;
+  int32_t wakeFDs[BUS_MAX_PROCESSES];
+  int32_t memFD;
+  void * mapping;
+  size_t mappingSize;
+  uint8_t * scratch;
+} Bus;
+
+// Must be called before forking, capacity is rounded up to a power of two number of pages. Returns 0 on success, -1 otherwise
+int8_t initBus(Bus * bus, uint64_t capacity, uint8_t processCount);
+// Unmaps the ring and closes every wake descriptor
+void freeBus(Bus * bus);
+
+// Called once in each process after forking, index 0 is the parent
+void busAttach(Bus * bus, uint8_t processIndex);
+// Becomes readable when records are waiting for this process
+int32_t busWakeFD(Bus const * bus);
+
+// Gathers parts into one record straight in the ring and wakes every process. Returns 0 on success, -1 if the record can never fit
+int8_t busPublish(Bus * bus, struct iovec const * parts, uint32_t partCount);
+// Hands every committed record to deliver, returns how many times this process fell a full ring behind and skipped ahead
+uint64_t busConsume(Bus * bus, void * context, void (*deliver)(uint8_t const * data, uint32_t length, void * context));
+
+#endif
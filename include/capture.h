@@ -0,0 +1,63 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "WSCAP001"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_HEADER_SIZE 18 // micros, connection, length, type, opcode
+
+typedef enum {
+  CAPTURE_HANDSHAKE = 1, // The raw upgrade request, also marks the start of a connection
+  CAPTURE_FRAME,         // One unmasked inbound frame payload
+  CAPTURE_CLOSE          // Close code, or the HTTP status of a refused upgrade, as a host order uint16_t
+} CaptureRecordType;
+
+typedef struct {
+  uint64_t micros;     // CLOCK_MONOTONIC, only differences between records mean anything. A file shared by cluster
+                       // processes is only in this order per process, readers have to sort by it
+  uint32_t connection; // Unique per capture file
+  uint32_t length;     // Payload bytes following the header
+  uint8_t type;
+  uint8_t opcode;      // CAPTURE_FRAME only
+} CaptureRecord;
+
+//Append only recorder. Producers copy records into a buffer under a short lock and a background thread writes
+//full buffers out. Every record is kept, a producer that finds the buffer full waits for the writer
+typedef struct {
+  int32_t fileFD;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t drained; // Signalled when the writer swaps buffers or finishes writing one
+  uint8_t * active;
+  uint8_t * writing;
+  size_t activeLength;
+  size_t bufferSize;
+  uint8_t isStopping;
+  uint8_t isWriting;
+  atomic_uint nextConnection;
+  uint32_t connectionBase;
+} Capture;
+
+// Truncates path and writes the file header, call once before any process starts recording into it. Returns 0 on success, -1 otherwise
+int8_t createCaptureFile(char const * path);
+
+// Appends to a file from createCaptureFile, connectionBase keeps ids apart when several processes share it. Returns 0 on success, -1 otherwise
+int8_t initCapture(Capture * capture, char const * path, size_t bufferSize, uint32_t connectionBase);
+// Writes out whatever is still buffered and stops the writer thread
+void freeCapture(Capture * capture);
+
+uint32_t captureConnection(Capture * capture);
+void captureRecord(Capture * capture, uint8_t type, uint32_t connection, uint8_t opcode, void const * data, uint32_t length);
+
+// Checks the file header, returns 0 on success, -1 otherwise
+int8_t openCaptureFile(FILE * file);
+// Reads the next record, growing *data as needed. Returns 1 on success, 0 at the end of the file, -1 on a damaged file
+int8_t readCaptureRecord(FILE * file, CaptureRecord * record, uint8_t ** data, size_t * capacity);
+
+#endif
@@ -4,16 +4,38 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define DSTRING_INLINE_SIZE 24
+
+//Strings shorter than DSTRING_INLINE_SIZE are kept inside the struct itself, so short ones never touch the heap
+//and a DString can still be copied by value (like Map does with its keys)
 typedef struct {
-  char * string;
-  size_t length;
-  size_t capacity;
+  size_t length;   // Not counting the terminator always kept after the last byte
+  size_t capacity; // DSTRING_INLINE_SIZE while the string is inline
+  union {
+    char * heap;
+    char small[DSTRING_INLINE_SIZE];
+  };
 } DString;
 
+//Borrowed bytes, not necessarily terminated, only valid as long as what they point into
+typedef struct {
+  char const * string;
+  size_t length;
+} DStringView;
+
 void * dstrinit(DString * str, char const * string, size_t const length);
 void dstrfree(DString * str);
 
+char * dstrdata(DString * str);
+DStringView dstrview(DString const * const str);
+DStringView dstrviewof(char const * string, size_t const length);
+
+// Return 1 if both hold the same bytes, 0 otherwise
 int8_t dstrcmp(DString const * const str1, DString const * const str2);
+int8_t dstrviewcmp(DStringView const str1, DStringView const str2);
+// Same value for a DString and any view of the same bytes
+uint32_t dstrhash(DStringView const str);
+
 DString * dstrcat(DString * dest, DString const * const src);
 DString * dstrcpy(DString * dest, DString const * const src);
 
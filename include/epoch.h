@@ -0,0 +1,46 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define EPOCH_MAX_READERS 16
+#define EPOCH_OFFLINE 0
+
+typedef struct EpochRetired EpochRetired;
+
+//Embedded in whatever gets retired, release gets this node back once nothing can see the object anymore
+struct EpochRetired {
+  EpochRetired * next;
+  uint64_t epoch;
+  void (*release)(EpochRetired * retired);
+};
+
+//Epoch based reclamation for read-mostly data. Readers never lock, they announce the global epoch at quiescent points
+//(where they hold no pointer into shared data) and go offline while blocked. Something retired at epoch E is released
+//once every reader is offline or has announced E or later
+typedef struct {
+  atomic_uint_fast64_t global;
+  atomic_uint_fast64_t readers[EPOCH_MAX_READERS];
+  uint32_t readerCount;
+  pthread_mutex_t lock;
+  EpochRetired * retired;
+  atomic_uint pending; // Retirements not released yet, lets readers skip collecting when there is nothing to do
+} EpochDomain;
+
+// Every reader starts offline. Returns 0 on success, -1 otherwise
+int8_t initEpochDomain(EpochDomain * domain, uint32_t readerCount);
+// Releases everything still retired, no reader may be online anymore
+void freeEpochDomain(EpochDomain * domain);
+
+// Marks a point where reader holds nothing, also brings an offline reader back before its next read
+void epochQuiescent(EpochDomain * domain, uint32_t reader);
+// reader holds nothing until its next epochQuiescent. Also releases retirements this reader was the last one holding back
+void epochOffline(EpochDomain * domain, uint32_t reader);
+
+// Must be called after the object was unpublished, also releases whatever older retirements are safe by now
+void epochRetire(EpochDomain * domain, EpochRetired * retired);
+void epochCollect(EpochDomain * domain);
+
+#endif
@@ -21,6 +21,9 @@ void freeMap(Map * map);
 int8_t mapPut(Map * map, void * key, void * value);
 void mapRemove(Map * map, void * key);
 void * mapGet(Map * map, void * key);
+//Looks up a key of another type than the stored ones, like a view of a stored string. cmp gets the stored key first,
+//hash has to agree with the map's own hash for keys that compare equal
+void * mapGetAs(Map * map, void * key, int8_t (*cmp)(void const * key1, void const  * key2), uint32_t (*hash)(void * key, size_t length));
 void mapClear(Map * map);
 void mapForEach(Map * map, void * context, void (*func)(void * key, void * value, void * context));
 
@@ -0,0 +1,68 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define TASK_POOL_MAX_THREADS 16
+
+typedef struct Task Task;
+typedef struct TaskDeque TaskDeque;
+typedef struct TaskPool TaskPool;
+typedef struct TaskStrand TaskStrand;
+
+//Intrusive unit of work, embed it in your own struct and recover it with offsetof inside run
+struct Task {
+  Task * next;
+  void (*run)(Task * task);
+  //A final task is the last one ever posted to its strand, the strand is not touched after it runs so it may be free'd by then
+  uint8_t isFinal;
+};
+
+struct TaskDeque {
+  pthread_mutex_t lock;
+  Task ** tasks;
+  uint32_t head;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+struct TaskPool {
+  pthread_t threads[TASK_POOL_MAX_THREADS];
+  TaskDeque queues[TASK_POOL_MAX_THREADS];
+  uint8_t threadCount;
+  uint8_t stopping;
+  atomic_uint pending;
+  atomic_uint nextQueue;
+  atomic_uint reserved; // Live strands, every queue keeps that many slots free for their runners
+  pthread_mutex_t idleLock;
+  pthread_cond_t idleCond;
+};
+
+//Runs posted tasks one at a time and in order, on whichever pool thread picks the strand up
+struct TaskStrand {
+  pthread_mutex_t lock;
+  Task * head;
+  Task * tail;
+  uint8_t scheduled;
+  Task runner;
+  TaskPool * pool;
+};
+
+// Returns 0 on success, -1 otherwise
+int8_t initTaskPool(TaskPool * pool, uint8_t threadCount);
+//Runs every task still queued, including ones they post, then stops and joins every pool thread
+void stopTaskPool(TaskPool * pool);
+//Stops the pool first if it is still running, strands must be free'd before this
+void freeTaskPool(TaskPool * pool);
+// Returns 0 on success, -1 when the task could not be queued, it is not run then
+int8_t taskPoolSubmit(TaskPool * pool, Task * task);
+
+// Reserves room in the pool for the strand's runner, so posting to it never fails. Returns 0 on success, -1 otherwise
+int8_t initTaskStrand(TaskStrand * strand, TaskPool * pool);
+// Only once the strand ran its final task or never had anything posted
+void freeTaskStrand(TaskStrand * strand);
+void taskStrandPost(TaskStrand * strand, Task * task);
+
+#endif
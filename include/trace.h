@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define TRACE_BUCKETS 32 // Bucket 0 is under 1us, bucket n covers [2^(n-1), 2^n) us
+
+typedef enum {
+  TRACE_QUEUE = 0, // Kernel receive timestamp to epoll_wait returning
+  TRACE_WAKEUP,    // epoll_wait returning to the read, other events of the batch go first
+  TRACE_DECODE,    // Read, unmask and validate up to the frame being handed over
+  TRACE_HANDLER,   // onMessage, pooled paths include the wait for a handler thread
+  TRACE_SEND,      // Handler done to the reply reaching the kernel, coalescing included
+  TRACE_STAGES
+} TraceStage;
+
+// Stage i runs from stamps[i] to stamps[i + 1], CLOCK_REALTIME nanoseconds to match kernel timestamps. 0 means not seen
+typedef struct {
+  uint64_t stamps[TRACE_STAGES + 1];
+  int32_t connection;
+  uint8_t isActive;
+} TraceSpan;
+
+typedef struct {
+  uint64_t counts[TRACE_STAGES][TRACE_BUCKETS];
+  uint64_t totalNanos[TRACE_STAGES];
+  uint64_t samples;
+} TraceHistograms;
+
+//Chrome trace (JSON array format) output, shared by every worker of a process
+typedef struct {
+  FILE * file;
+  pthread_mutex_t lock;
+  uint8_t hasEvents;
+  int32_t pid;
+} TraceWriter;
+
+uint64_t traceNow(void);
+
+// Returns 0 on success, -1 otherwise
+int8_t initTraceWriter(TraceWriter * writer, char const * path);
+// Closes the JSON array so the file loads as is
+void freeTraceWriter(TraceWriter * writer);
+
+void traceRecord(TraceHistograms * histograms, TraceSpan const * span);
+void traceWriteSpan(TraceWriter * writer, TraceSpan const * span, uint32_t thread);
+
+void traceMergeHistograms(TraceHistograms * into, TraceHistograms const * from);
+// One line per stage with sample count, mean and percentiles (upper bucket bounds)
+void traceWriteHistograms(TraceHistograms const * histograms, FILE * out);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Carries a code point split across calls, so messages can be validated fragment by fragment
+typedef struct {
+  uint8_t pending[4];
+  uint8_t pendingLength;
+  uint8_t isInvalid;
+} UTF8State;
+
+//Returns 1 if the whole buffer is valid UTF-8, 0 otherwise. Picks AVX2, SSE4.1 or scalar code at runtime
+uint8_t utf8Validate(uint8_t const * data, size_t length);
+uint8_t utf8ValidateScalar(uint8_t const * data, size_t length);
+
+void utf8Init(UTF8State * state);
+// Returns 0 while the bytes seen so far can still be valid, -1 otherwise
+int8_t utf8Update(UTF8State * state, uint8_t const * data, size_t length);
+// Returns 0 if the stream ended on a code point boundary, -1 otherwise
+int8_t utf8Finish(UTF8State * state);
+
+#endif
@@ -3,63 +3,350 @@
 
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <stdatomic.h>
 
+#include "admission.h"
+#include "arena.h"
+#include "bus.h"
+#include "capture.h"
+#include "epoch.h"
 #include "hashmap.h"
+#include "taskpool.h"
+#include "trace.h"
 
 #define WS_MAX_THREADS 4
+#define WS_POOL_THREADS 4
+#define WS_FRAME_HEADER_MAX 10
+#define WS_MAX_LISTENERS 8
+#define WS_MESSAGE_BATCH_MAX 256
 
 typedef struct WSPathHandler WSPathHandler;
+typedef struct WSRouteTable WSRouteTable;
+typedef struct WSMessageView WSMessageView;
 typedef struct WSConnection WSConnection;
 typedef struct WSWorker WSWorker;
 typedef struct WSSocket WSSocket;
+typedef struct WSHandlerTask WSHandlerTask;
+typedef struct WSOutFrame WSOutFrame;
+typedef struct WSStream WSStream;
+typedef struct WSAdmission WSAdmission;
+typedef struct WSListener WSListener;
+typedef struct WSMemoryPolicy WSMemoryPolicy;
+typedef struct WSBusyPoll WSBusyPoll;
+typedef struct WSWorkerStats WSWorkerStats;
+typedef struct WSRouteMembers WSRouteMembers;
+
+typedef enum {
+  WS_EXEC_INLINE = 0, // Handlers run on the connection's I/O worker
+  WS_EXEC_POOLED      // Handlers run on the handler pool, one at a time per connection
+} WSExecMode;
+
+// A message handed to onMessageBatch, not NUL terminated and only valid for the duration of the call
+struct WSMessageView {
+  char const * data;
+  size_t length;
+};
 
 struct WSPathHandler {
   void (*onHandshake)(WSConnection const * const client);
   void (*onDisconnect)(WSConnection const * const client);
   size_t (*onMessage)(WSConnection const * const client, char const * const incData, char ** const outData);
+  void (*onMessageBatch)(WSConnection const * const client, WSMessageView const * const messages, uint32_t const count); // Takes over from onMessage when set
+  WSExecMode execMode;
+  uint64_t routeID;        // Shared by every version of the same path, a changed path gets a new WSPathHandler
+  atomic_uint references;  // Route tables and connections holding it, never changed after it is published
+};
+
+//Immutable once published, writers swap in a modified copy and the old one is released through the epoch domain
+struct WSRouteTable {
+  Map paths; // DString to WSPathHandler *, both owned by the table
+  EpochRetired retired;
+};
+
+typedef enum {
+  WS_PAYLOAD_OWNED = 0, // allocation is free'd once the frame is written
+  WS_PAYLOAD_BATCH,     // Lives in the worker's reply arena, moved to the heap if still queued when the loop iteration ends
+  WS_PAYLOAD_STREAM     // allocation is a WSStream that writes its own headers, payload and length are unused
+} WSPayloadOwnership;
+
+struct WSOutFrame {
+  uint8_t header[WS_FRAME_HEADER_MAX];
+  uint8_t headerLength; // 0 when the header was written in place in front of the payload
+  uint8_t ownership;
+  char * payload;
+  size_t length;
+  size_t written; // Bytes of header + payload already handed to the kernel
+  void * allocation;
+};
+
+//A message whose body goes from a file with sendfile or straight from caller owned memory, one fragment at a time
+struct WSStream {
+  int32_t fileFD;      // -1 when the body is region
+  off_t fileOffset;
+  char const * region;
+  size_t length;
+  size_t sent;         // Body bytes already handed to the kernel
+  size_t chunkSize;    // 0 for a single frame
+  size_t chunkLeft;    // Body bytes of the current fragment still to write
+  uint8_t opcode;
+  uint8_t header[WS_FRAME_HEADER_MAX];
+  uint8_t headerLength;
+  uint8_t headerWritten;
+  uint8_t isStarted;
+  uint8_t isComplete;
+  void (*onDone)(WSConnection const * const client, void * const context, int8_t const status);
+  void * context;
+  WSStream * nextFinished; // Only while onDone waits for the handler that started the stream to return
+};
+
+struct WSAdmission {
+  uint32_t backlog;              // listen() backlog, only applies to sockets bound after it is set
+  uint32_t acceptBudget;         // Connections accepted per wakeup of the accept loop
+  uint32_t maxPendingHandshakes; // Accepted connections still waiting on their upgrade request, 0 for no limit
+  uint32_t handshakeTimeoutMs;   // Accepted connections without an upgrade request by then are closed with 408, 0 for the default
+  double connectionsPerSecond;   // Sustained rate allowed per source address, 0 for no limit
+  double connectionBurst;        // Connections a source address may open at once
+};
+
+struct WSMemoryPolicy {
+  size_t readBufferSize;   // Per worker, frames up to this size are decoded in place without any per connection memory
+  size_t keepPartialBytes; // Partial frame buffers up to this size stay with the connection for the next one, 0 frees them right away
+  uint32_t keepOutFrames;  // Output queue slots a connection keeps once its queue drains, longer queues are shrunk back
+  size_t maxMessageSize;   // Larger frames close the connection with 1009
+};
+
+struct WSBusyPoll {
+  uint32_t spinMicros;           // Workers poll without blocking this long before going to sleep, 0 always blocks
+  uint32_t socketBusyPollMicros; // SO_BUSY_POLL on client sockets, 0 leaves the system default
+  uint8_t preferBusyPoll;        // SO_PREFER_BUSY_POLL on client sockets
+  uint8_t pinWorkers;            // Pins workers to the cores in cpus, 0 leaves every worker to the scheduler
+  int32_t cpus[WS_MAX_THREADS];  // Core of each worker with pinWorkers set, -1 leaves that one to the scheduler
+};
+
+// Where a worker's time went, busy is everything outside of epoll_wait
+struct WSWorkerStats {
+  uint64_t busyNanos;
+  uint64_t spinNanos;
+  uint64_t blockNanos;
+  uint64_t spinWakeups;  // Events found while spinning
+  uint64_t blockWakeups; // Events that had to wake the worker up
+};
+
+// Upgraded connections of one worker on one route, a slot whose first is -1 is free for the next route
+struct WSRouteMembers {
+  uint64_t routeID;
+  int32_t first;
 };
 
 struct WSConnection {
   int32_t clientFD;
   int8_t needsHandshake;
   uint8_t assignedThread;
-  char * recvBuffer;
-  char * sendBuffer;
-  struct sockaddr_in addrInfo;
+  uint64_t handshakeDeadline; // Monotonic micros, 0 until the worker has seen the connection or once it upgraded
+  int32_t prevHandshake;      // Neighbours in the worker's handshake deadline list, by descriptor
+  int32_t nextHandshake;
+  int8_t isRouteMember;       // Linked into its worker's members of pathHanlder's route, by descriptor, while it can get broadcasts
+  int32_t prevRouteMember;
+  int32_t nextRouteMember;
+  uint8_t * partialFrame; // Only held while a frame is split across reads (or kept under WSMemoryPolicy.keepPartialBytes)
+  size_t partialLength;
+  size_t partialCapacity;
+  size_t partialNeeded;   // Size of the whole frame, 0 while its header is still incomplete
+  uint32_t captureID;     // 0 when the connection is not being captured
+  struct sockaddr_storage addrInfo;
+  socklen_t addrLength;
   WSPathHandler * pathHanlder;
+  TaskStrand * strand;
+  WSHandlerTask * disconnectTask; // Allocated along with strand, so a pooled connection can always be closed
+  int8_t isClosing;
+  int8_t isQueued;
+  int8_t waitsWritable;
+  WSOutFrame * outFrames;
+  uint32_t outCount;
+  uint32_t outCapacity;
+  size_t outBytes;
+  void * userContext;
+  Arena sessionArena; // Released in one go when the connection is closed
 };
 
 struct WSWorker {
   pthread_t thread;
   int32_t workerOpts;
   int32_t workerEventPoll;
+  int32_t completionFD;
+  pthread_mutex_t completionLock;
+  WSHandlerTask * completions;
+  int32_t * queuedFDs; // Connections with frames waiting for the end of this loop iteration
+  uint32_t queuedCount;
+  uint64_t firstQueuedAt;
+  int32_t firstHandshake; // Connections waiting on their upgrade request, earliest deadline first, -1 when there are none
+  int32_t lastHandshake;
+  uint8_t * readBuffer; // Every read lands here first, sized by WSMemoryPolicy.readBufferSize
+  WSMessageView * batch; // Messages decoded from the current read for a path with onMessageBatch
+  uint32_t batchCount;
+  uint64_t wokeAt;      // Only kept up to date while tracing
+  uint32_t traceCountdown;
+  TraceSpan traceSpan;  // At most one sampled message in flight per worker
+  TraceHistograms traceHistograms;
+  WSWorkerStats stats;
+  Arena replyArena;
+  WSHandlerTask * retiredBroadcasts; // Payloads frames still point at, free'd with the reply arena
+  WSRouteMembers * routeMembers; // Where broadcasts go, only touched by this worker
+  uint32_t routeMemberCount;
   WSSocket * socket;
 };
 
+struct WSListener {
+  int32_t listenerFD;
+  struct sockaddr_storage addrInfo;
+  socklen_t addrLength;
+  int32_t v6Only;
+};
+
 struct WSSocket {
-  int32_t socketFD;
-  int32_t socketOpts;
   int32_t socketEventPoll;
-  struct sockaddr_in addrInfo;
+  WSListener listeners[WS_MAX_LISTENERS];
+  uint8_t listenerCount;
   WSWorker threads[WS_MAX_THREADS];
   WSConnection * connections;
-  Map paths;
+  _Atomic(WSRouteTable *) routes;
+  pthread_mutex_t routeLock; // Serializes writers, readers never take it
+  EpochDomain routeEpochs;   // One reader per worker plus the accept loop
+  uint64_t lastRouteID;
+  TaskPool handlerPool;
+  uint8_t hasHandlerPool;
+  uint8_t isRouting; // Set under routeLock once runSocketLoop has settled on hasHandlerPool
+  size_t coalesceMaxBytes;
+  uint32_t coalesceMaxDelayUs;
+  size_t streamChunkSize;
+  WSAdmission admission;
+  WSMemoryPolicy memory;
+  WSBusyPoll busyPoll;
+  AdmissionTable rateLimits;
+  atomic_uint pendingHandshakes;
+  uint8_t clusterProcesses;
+  uint8_t clusterIndex; // 0 in the process that called runSocketLoop
+  pid_t clusterPIDs[BUS_MAX_PROCESSES];
+  Bus bus;
+  uint8_t hasBus;
+  char * capturePath;
+  Capture capture;
+  uint8_t isCapturing;
+  uint32_t traceSampleEvery;
+  char * tracePath;
+  TraceWriter traceWriter;
 };
 
 // Returns 0 on success, -1 otherwise
 int8_t initSocket(WSSocket * socketInfo);
 
-// Returns 0 on success, -1 otherwise
+// Listens on every interface, over both IPv6 and IPv4 where the system allows it. Returns 0 on success, -1 otherwise
 int8_t bindSocket(WSSocket * socketInfo, unsigned int const port);
 
+// Listens on a single IPv4 or IPv6 address. Returns 0 on success, -1 otherwise
+int8_t bindSocketAddress(WSSocket * socketInfo, char const * const address, unsigned int const port);
+
+// Listens on a Unix domain stream socket, a leading '@' puts it in the abstract namespace. Returns 0 on success, -1 otherwise
+int8_t bindSocketUnix(WSSocket * socketInfo, char const * const path);
+
 void closeSocket(WSSocket * socketInfo);
 
-// Returns 0 on success
+// Messages on path go to onMessageBatch instead of onMessage, every complete one decoded from a single read in one call
+// (at most WS_MESSAGE_BATCH_MAX). Replies are sent with getReplyBuffer/commitReply and go out together. NULL goes back to
+// onMessage. Same rules as addValidPath, returns 0 on success
+int8_t setPathBatchHandler(WSSocket * const socketInfo, char const * const path,
+    void (*onMessageBatch)(WSConnection const * const client, WSMessageView const * const messages, uint32_t const count));
+
+// Safe from any thread, also while runSocketLoop is running. Connections that already upgraded keep the handlers they
+// were matched with. In cluster mode, once running, only the calling process changes. Returns 0 on success
 int8_t addValidPath(WSSocket * const socketInfo, char const * const path,
     void (*onHandshake)(WSConnection const * const client),
     void (*onDisconnect)(WSConnection const * const client),
     size_t (*onMessage)(WSConnection const * const client, char const * const incData, char ** const outData));
 
+// Stops accepting upgrades on path, same rules as addValidPath. Returns 0 on success
+int8_t removeValidPath(WSSocket * const socketInfo, char const * const path);
+
+// Hands out a buffer for at least size bytes of reply payload with room for the frame header in front of it.
+// Only valid inside onHandshake or onMessage for the client the handler was called with, returns NULL otherwise
+char * getReplyBuffer(WSConnection const * const client, size_t const size);
+
+// Sends the first size bytes of the last buffer from getReplyBuffer as a text message, without copying it.
+// Committed replies go out before the one returned from onMessage. Returns 0 on success, -1 otherwise
+int8_t commitReply(WSConnection const * const client, size_t const size);
+
+// Sends length bytes of fileFD from offset as one message, split into fragments (see setStreamChunking), with sendfile.
+// fileFD must stay open until onDone runs on the connection's worker with status 0 once everything was written, or -1 if
+// the connection went away first. onDone may be NULL. It never runs inside the handler that started the stream, even when
+// a small stream is written out right away, and on a pooled path it is not serialized with the pooled handlers.
+// Only valid inside onHandshake or onMessage for the client the handler was called with, the message goes out after the
+// replies committed so far. Returns 0 on success, -1 otherwise
+int8_t streamFile(WSConnection const * const client, int32_t const fileFD, off_t const offset, size_t const length, uint8_t const isBinary,
+    void (*onDone)(WSConnection const * const client, void * const context, int8_t const status), void * const context);
+
+// Same as streamFile for memory that stays valid until onDone, such as an mmap'd file. The body is never copied in user space
+int8_t streamRegion(WSConnection const * const client, void const * const region, size_t const length, uint8_t const isBinary,
+    void (*onDone)(WSConnection const * const client, void * const context, int8_t const status), void * const context);
+
+// Streamed messages are split into fragments of chunkSize body bytes, 0 sends each one as a single frame
+void setStreamChunking(WSSocket * const socketInfo, size_t const chunkSize);
+
+// The context starts out NULL and is never touched by the server, pooled handlers of one connection never run concurrently
+void setUserContext(WSConnection const * const client, void * const context);
+void * getUserContext(WSConnection const * const client);
+#define WS_USER_CONTEXT(client, type) ((type *)getUserContext(client))
+
+// Memory for session state that stays valid until the connection is closed, after onDisconnect has run. Aligned to
+// ARENA_ALIGNMENT and not zeroed. Only valid inside onHandshake or onMessage for the client the handler was called with,
+// returns NULL otherwise
+void * allocSessionMemory(WSConnection const * const client, size_t const size);
+
+// Chooses where the handlers of an already added path run for connections upgraded from now on, same rules as addValidPath.
+// Once running, WS_EXEC_POOLED needs a handler pool, which only exists if some path was pooled at start. Returns 0 on success
+int8_t setPathExecution(WSSocket * const socketInfo, char const * const path, WSExecMode const mode);
+
+// Frames queued during one event loop iteration are written together, up to maxBytes per connection
+// or maxDelayUs after the first one was queued, whichever comes first. maxBytes of 0 writes every frame right away
+void setOutputCoalescing(WSSocket * const socketInfo, size_t const maxBytes, uint32_t const maxDelayUs);
+
+// Connections over the limits are answered with a bare 429 or 503 and closed before any handshake work
+// Returns 0 on success, -1 otherwise
+int8_t setAdmissionControl(WSSocket * const socketInfo, WSAdmission const * const admission);
+
+// runSocketLoop forks processes - 1 more copies of the server, each with its own workers and handler pool, that share
+// the listening addresses through SO_REUSEPORT. Must be called before binding. Returns 0 on success, -1 otherwise
+int8_t setClusterMode(WSSocket * const socketInfo, uint8_t const processes);
+
+// Sends data as a text message to every connection on path, in every process of the cluster. Safe from any thread
+// once runSocketLoop has started, delivery is best effort. Returns 0 on success, -1 otherwise
+int8_t broadcastMessage(WSSocket * const socketInfo, char const * const path, char const * const data, size_t const size);
+
+// Records every upgrade request, inbound frame and close to path (truncated first) for examples/replay.c.
+// Must be called before runSocketLoop. Returns 0 on success, -1 otherwise
+int8_t enableCapture(WSSocket * const socketInfo, char const * const path);
+
+// Follows one read in every sampleEvery per worker from the kernel receive timestamp to the reply leaving, sampleEvery of 0
+// turns it off. Sampled spans also go to tracePath in Chrome trace format unless it is NULL, cluster processes add .<index>
+// to it. Must be called before runSocketLoop. Returns 0 on success, -1 otherwise
+int8_t enableTracing(WSSocket * const socketInfo, uint32_t const sampleEvery, char const * const tracePath);
+
+// Per stage latency histograms of every message sampled so far in this process
+void writeLatencyReport(WSSocket * const socketInfo, FILE * const out);
+
+// Trades CPU for wakeup latency, see WSBusyPoll. Must be called before runSocketLoop. Returns 0 on success, -1 otherwise
+int8_t setBusyPolling(WSSocket * const socketInfo, WSBusyPoll const * const busyPoll);
+
+// Busy, spinning and blocked time of every worker since runSocketLoop started
+void writeWorkerReport(WSSocket * const socketInfo, FILE * const out);
+
+// Must be called before runSocketLoop. Returns 0 on success, -1 otherwise
+int8_t setMemoryPolicy(WSSocket * const socketInfo, WSMemoryPolicy const * const policy);
+
+// Heap and socket table bytes currently held for the connection, not counting what the kernel buffers
+size_t getConnectionMemory(WSConnection const * const client);
+
 void runSocketLoop(WSSocket * const socketInfo, void (*onConnect)(WSConnection const * const client));
 
 #endif
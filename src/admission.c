@@ -0,0 +1,77 @@
+#include "admission.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define AD_PROBE_LIMIT 8
+
+static uint32_t hashAddress(uint8_t const address[ADMISSION_ADDRESS_SIZE]) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < ADMISSION_ADDRESS_SIZE; i++) {
+    hash ^= address[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+int8_t initAdmissionTable(AdmissionTable * table, uint32_t capacity, double ratePerSecond, double burst) {
+  memset(table, 0, sizeof(AdmissionTable));
+  if (capacity == 0 || ratePerSecond <= 0 || burst < 1)
+    return -1;
+
+  table->capacity = 1;
+  while (table->capacity < capacity)
+    table->capacity = table->capacity << 1;
+
+  if ((table->buckets = calloc(table->capacity, sizeof(AdmissionBucket))) == NULL)
+    return -1;
+
+  table->ratePerSecond = ratePerSecond;
+  table->burst = burst;
+  table->refillMicros = (uint64_t)(burst / ratePerSecond * 1e6) + 1;
+  return 0;
+}
+
+void freeAdmissionTable(AdmissionTable * table) {
+  free(table->buckets);
+  memset(table, 0, sizeof(AdmissionTable));
+}
+
+uint8_t admissionTake(AdmissionTable * table, uint8_t const address[ADMISSION_ADDRESS_SIZE], uint64_t nowMicros) {
+  uint32_t const mask = table->capacity - 1;
+  uint32_t const start = hashAddress(address) & mask;
+
+  AdmissionBucket * bucket = NULL;
+  AdmissionBucket * oldest = NULL;
+  for (uint32_t i = 0; i < AD_PROBE_LIMIT; i++) {
+    AdmissionBucket * const candidate = &(table->buckets[(start + i) & mask]);
+    if (candidate->lastSeen != 0 && memcmp(candidate->address, address, ADMISSION_ADDRESS_SIZE) == 0) {
+      bucket = candidate;
+      break;
+    }
+    if (oldest == NULL || candidate->lastSeen < oldest->lastSeen)
+      oldest = candidate;
+  }
+
+  if (bucket == NULL) {
+    //An aged out bucket is indistinguishable from a fresh one. If every slot in the window is busy the
+    //least recently seen address loses its history, which only ever errs on the side of admitting
+    bucket = oldest;
+    memcpy(bucket->address, address, ADMISSION_ADDRESS_SIZE);
+    bucket->tokens = table->burst;
+  } else if (nowMicros - bucket->lastSeen >= table->refillMicros) {
+    bucket->tokens = table->burst;
+  } else {
+    bucket->tokens += (nowMicros - bucket->lastSeen) * table->ratePerSecond / 1e6;
+    if (bucket->tokens > table->burst)
+      bucket->tokens = table->burst;
+  }
+  bucket->lastSeen = (nowMicros == 0) ? 1 : nowMicros;
+
+  if (bucket->tokens < 1)
+    return 0;
+  bucket->tokens -= 1;
+  return 1;
+}
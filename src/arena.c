@@ -0,0 +1,69 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static ArenaChunk * newChunk(Arena * arena, size_t capacity) {
+  ArenaChunk * chunk = malloc(sizeof(ArenaChunk) + capacity);
+  if (chunk == NULL)
+    return NULL;
+
+  chunk->capacity = capacity;
+  chunk->used = 0;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->allocated += sizeof(ArenaChunk) + capacity;
+  return chunk;
+}
+
+void initArena(Arena * arena, size_t chunkSize) {
+  memset(arena, 0, sizeof(Arena));
+  arena->chunkSize = chunkSize;
+}
+
+void * arenaAlloc(Arena * arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  ArenaChunk * chunk = arena->chunks;
+  if (chunk == NULL || chunk->capacity - chunk->used < size) {
+    // Oversized requests get a chunk of their own
+    if ((chunk = newChunk(arena, (size > arena->chunkSize) ? size : arena->chunkSize)) == NULL)
+      return NULL;
+  }
+
+  void * memory = chunk->data + chunk->used;
+  chunk->used += size;
+  return memory;
+}
+
+void arenaReset(Arena * arena) {
+  ArenaChunk * kept = NULL;
+  ArenaChunk * chunk = arena->chunks;
+  while (chunk != NULL) {
+    ArenaChunk * next = chunk->next;
+    if (kept == NULL && chunk->capacity == arena->chunkSize) {
+      kept = chunk;
+    } else {
+      arena->allocated -= sizeof(ArenaChunk) + chunk->capacity;
+      free(chunk);
+    }
+    chunk = next;
+  }
+
+  if (kept != NULL) {
+    kept->used = 0;
+    kept->next = NULL;
+  }
+  arena->chunks = kept;
+}
+
+void freeArena(Arena * arena) {
+  ArenaChunk * chunk = arena->chunks;
+  while (chunk != NULL) {
+    ArenaChunk * next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  arena->allocated = 0;
+}
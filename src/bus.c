@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include "bus.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#define BUS_ALIGNMENT 8
+#define BUS_MAX_RECORD(bus) ((bus)->capacity / 4)
+
+typedef struct {
+  atomic_uint_fast64_t stamp; // Absolute position + 1 once the record is complete
+  uint32_t length;
+  uint32_t check;
+} BusRecord;
+
+static uint64_t recordSize(uint32_t length) {
+  return (sizeof(BusRecord) + length + BUS_ALIGNMENT - 1) & ~(uint64_t)(BUS_ALIGNMENT - 1);
+}
+
+//Stale bytes from an older lap could pass for a stamp, they can't also match a check keyed on a per-ring secret
+static uint32_t recordCheck(uint64_t stamp, uint32_t length, uint64_t secret) {
+  uint64_t mixed = (stamp ^ secret) * 0x9E3779B97F4A7C15ull;
+  mixed ^= length;
+  mixed *= 0xBF58476D1CE4E5B9ull;
+  return (uint32_t)(mixed >> 32);
+}
+
+int8_t initBus(Bus * bus, uint64_t capacity, uint8_t processCount) {
+  memset(bus, 0, sizeof(Bus));
+  bus->memFD = -1;
+  for (uint8_t i = 0; i < BUS_MAX_PROCESSES; i++)
+    bus->wakeFDs[i] = -1;
+
+  if (processCount == 0 || processCount > BUS_MAX_PROCESSES)
+    return -1;
+  bus->processCount = processCount;
+
+  uint64_t const pageSize = sysconf(_SC_PAGESIZE);
+  bus->capacity = pageSize;
+  while (bus->capacity < capacity)
+    bus->capacity = bus->capacity << 1;
+
+  if ((bus->memFD = memfd_create("ws-bus", MFD_CLOEXEC)) == -1)
+    goto freeBus;
+  if (ftruncate(bus->memFD, pageSize + bus->capacity) == -1)
+    goto freeBus;
+
+  //The ring is mapped twice back to back, so a record running off the end just continues at the start
+  bus->mappingSize = pageSize + 2 * bus->capacity;
+  if ((bus->mapping = mmap(NULL, bus->mappingSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    bus->mapping = NULL;
+    goto freeBus;
+  }
+  uint8_t * const base = bus->mapping;
+  if (mmap(base, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, bus->memFD, 0) == MAP_FAILED)
+    goto freeBus;
+  if (mmap(base + pageSize, bus->capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, bus->memFD, pageSize) == MAP_FAILED)
+    goto freeBus;
+  if (mmap(base + pageSize + bus->capacity, bus->capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, bus->memFD, pageSize) == MAP_FAILED)
+    goto freeBus;
+  bus->header = (BusHeader *)base;
+  bus->ring = base + pageSize;
+
+  if (getrandom(&(bus->header->secret), sizeof(bus->header->secret), 0) != sizeof(bus->header->secret))
+    goto freeBus;
+
+  for (uint8_t i = 0; i < processCount; i++)
+    if ((bus->wakeFDs[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      goto freeBus;
+
+  return 0;
+
+  freeBus:
+    freeBus(bus);
+    return -1;
+}
+
+void freeBus(Bus * bus) {
+  if (bus->mapping != NULL)
+    munmap(bus->mapping, bus->mappingSize);
+  if (bus->memFD != -1)
+    close(bus->memFD);
+  for (uint8_t i = 0; i < BUS_MAX_PROCESSES; i++)
+    if (bus->wakeFDs[i] != -1)
+      close(bus->wakeFDs[i]);
+  free(bus->scratch);
+
+  memset(bus, 0, sizeof(Bus));
+  bus->memFD = -1;
+  for (uint8_t i = 0; i < BUS_MAX_PROCESSES; i++)
+    bus->wakeFDs[i] = -1;
+}
+
+void busAttach(Bus * bus, uint8_t processIndex) {
+  bus->processIndex = processIndex;
+  bus->readCursor = atomic_load(&(bus->header->reserved));
+}
+
+int32_t busWakeFD(Bus const * bus) {
+  return bus->wakeFDs[bus->processIndex];
+}
+
+int8_t busPublish(Bus * bus, struct iovec const * parts, uint32_t partCount) {
+  uint64_t length = 0;
+  for (uint32_t i = 0; i < partCount; i++)
+    length += parts[i].iov_len;
+  if (length > BUS_MAX_RECORD(bus))
+    return -1;
+
+  uint64_t const position = atomic_fetch_add(&(bus->header->reserved), recordSize(length));
+  BusRecord * const record = (BusRecord *)(bus->ring + (position & (bus->capacity - 1)));
+  record->length = length;
+  record->check = recordCheck(position + 1, length, bus->header->secret);
+
+  uint8_t * data = (uint8_t *)(record + 1);
+  for (uint32_t i = 0; i < partCount; i++) {
+    memcpy(data, parts[i].iov_base, parts[i].iov_len);
+    data += parts[i].iov_len;
+  }
+  atomic_store_explicit(&(record->stamp), position + 1, memory_order_release);
+
+  //One wakeup per reader until it drains, however many records land in between
+  uint64_t const wake = 1;
+  for (uint8_t i = 0; i < bus->processCount; i++)
+    if (atomic_exchange(&(bus->header->wakePending[i]), 1) == 0)
+      write(bus->wakeFDs[i], &wake, sizeof(wake));
+
+  return 0;
+}
+
+uint64_t busConsume(Bus * bus, void * context, void (*deliver)(uint8_t const * data, uint32_t length, void * context)) {
+  uint64_t wakes;
+  read(busWakeFD(bus), &wakes, sizeof(wakes));
+  //Cleared before reading, so anything committed from here on wakes us again
+  atomic_store(&(bus->header->wakePending[bus->processIndex]), 0);
+
+  if (bus->scratch == NULL && (bus->scratch = malloc(BUS_MAX_RECORD(bus))) == NULL)
+    return 0;
+
+  uint64_t skips = 0;
+  for (;;) {
+    uint64_t const cursor = bus->readCursor;
+    uint64_t const reserved = atomic_load(&(bus->header->reserved));
+    if (reserved == cursor)
+      break;
+    if (reserved - cursor > bus->capacity) {
+      skips++;
+      bus->readCursor = reserved;
+      continue;
+    }
+
+    BusRecord * const record = (BusRecord *)(bus->ring + (cursor & (bus->capacity - 1)));
+    if (atomic_load_explicit(&(record->stamp), memory_order_acquire) != cursor + 1)
+      break; // Still being written, its producer wakes us once it is done
+
+    uint32_t const length = record->length;
+    if (length > BUS_MAX_RECORD(bus) || record->check != recordCheck(cursor + 1, length, bus->header->secret)) {
+      skips++;
+      bus->readCursor = atomic_load(&(bus->header->reserved));
+      continue;
+    }
+    memcpy(bus->scratch, record + 1, length);
+
+    //A producer a full lap ahead may have written over the record while we copied it
+    if (atomic_load(&(bus->header->reserved)) - cursor > bus->capacity) {
+      skips++;
+      bus->readCursor = atomic_load(&(bus->header->reserved));
+      continue;
+    }
+
+    bus->readCursor = cursor + recordSize(length);
+    deliver(bus->scratch, length, context);
+  }
+
+  return skips;
+}
@@ -0,0 +1,237 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_FLUSH_MS 100
+
+static uint64_t monotonicMicros(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int8_t writeAll(int32_t fd, uint8_t const * data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += written;
+    length -= written;
+  }
+  return 0;
+}
+
+// One writev so the record stays in one piece next to other processes' O_APPEND writes
+static int8_t writeRecord(int32_t fd, uint8_t const * header, void const * data, uint32_t length) {
+  struct iovec parts[2] = {
+    { .iov_base = (void *)header, .iov_len = CAPTURE_HEADER_SIZE },
+    { .iov_base = (void *)data, .iov_len = length }
+  };
+  struct iovec * part = parts;
+  uint8_t partCount = 2;
+  while (partCount > 0) {
+    ssize_t written = writev(fd, part, partCount);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (partCount > 0 && (size_t)written >= part->iov_len) {
+      written -= part->iov_len;
+      part++;
+      partCount--;
+    }
+    if (partCount > 0) {
+      part->iov_base = (uint8_t *)part->iov_base + written;
+      part->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+static void * writerLoop(void * args) {
+  Capture * capture = args;
+
+  pthread_mutex_lock(&(capture->lock));
+  for (;;) {
+    if (capture->activeLength == 0) {
+      if (capture->isStopping)
+        break;
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&(capture->wake), &(capture->lock), &deadline);
+      continue;
+    }
+
+    // Producers keep filling the other buffer while this one goes to disk
+    uint8_t * const full = capture->active;
+    size_t const length = capture->activeLength;
+    capture->active = capture->writing;
+    capture->activeLength = 0;
+    capture->writing = full;
+    capture->isWriting = 1;
+    pthread_cond_broadcast(&(capture->drained));
+    pthread_mutex_unlock(&(capture->lock));
+
+    if (writeAll(capture->fileFD, full, length) == -1)
+      printf("(Capture): Could not write %zu bytes: %s\n", length, strerror(errno));
+
+    pthread_mutex_lock(&(capture->lock));
+    capture->isWriting = 0;
+    pthread_cond_broadcast(&(capture->drained));
+  }
+  pthread_mutex_unlock(&(capture->lock));
+
+  return NULL;
+}
+
+int8_t createCaptureFile(char const * path) {
+  int32_t fd;
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+    return -1;
+
+  int8_t const result = writeAll(fd, (uint8_t const *)CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+  close(fd);
+  return result;
+}
+
+int8_t initCapture(Capture * capture, char const * path, size_t bufferSize, uint32_t connectionBase) {
+  memset(capture, 0, sizeof(Capture));
+  capture->fileFD = -1;
+
+  // O_APPEND keeps every buffer in one piece when processes share the file
+  if ((capture->fileFD = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) == -1)
+    return -1;
+
+  capture->bufferSize = bufferSize;
+  if ((capture->active = malloc(bufferSize)) == NULL || (capture->writing = malloc(bufferSize)) == NULL)
+    goto freeCapture;
+
+  capture->connectionBase = connectionBase;
+  pthread_mutex_init(&(capture->lock), NULL);
+  pthread_cond_init(&(capture->wake), NULL);
+  pthread_cond_init(&(capture->drained), NULL);
+  if (pthread_create(&(capture->writer), NULL, writerLoop, capture) != 0) {
+    pthread_mutex_destroy(&(capture->lock));
+    pthread_cond_destroy(&(capture->wake));
+    pthread_cond_destroy(&(capture->drained));
+    goto freeCapture;
+  }
+
+  return 0;
+
+  freeCapture:
+    free(capture->active);
+    free(capture->writing);
+    close(capture->fileFD);
+    memset(capture, 0, sizeof(Capture));
+    capture->fileFD = -1;
+    return -1;
+}
+
+void freeCapture(Capture * capture) {
+  if (capture->fileFD == -1)
+    return;
+
+  pthread_mutex_lock(&(capture->lock));
+  capture->isStopping = 1;
+  pthread_cond_signal(&(capture->wake));
+  pthread_mutex_unlock(&(capture->lock));
+  pthread_join(capture->writer, NULL);
+
+  pthread_mutex_destroy(&(capture->lock));
+  pthread_cond_destroy(&(capture->wake));
+  pthread_cond_destroy(&(capture->drained));
+  free(capture->active);
+  free(capture->writing);
+  close(capture->fileFD);
+  memset(capture, 0, sizeof(Capture));
+  capture->fileFD = -1;
+}
+
+uint32_t captureConnection(Capture * capture) {
+  return capture->connectionBase + atomic_fetch_add(&(capture->nextConnection), 1) + 1;
+}
+
+void captureRecord(Capture * capture, uint8_t type, uint32_t connection, uint8_t opcode, void const * data, uint32_t length) {
+  uint8_t header[CAPTURE_HEADER_SIZE];
+  uint64_t const micros = monotonicMicros();
+  memcpy(header, &micros, 8);
+  memcpy(header + 8, &connection, 4);
+  memcpy(header + 12, &length, 4);
+  header[16] = type;
+  header[17] = opcode;
+
+  size_t const recordSize = CAPTURE_HEADER_SIZE + length;
+  pthread_mutex_lock(&(capture->lock));
+  if (recordSize > capture->bufferSize) {
+    // Too big for any buffer, it goes straight to the file once everything before it is out
+    pthread_cond_signal(&(capture->wake));
+    while (capture->activeLength != 0 || capture->isWriting)
+      pthread_cond_wait(&(capture->drained), &(capture->lock));
+    if (writeRecord(capture->fileFD, header, data, length) == -1)
+      printf("(Capture): Could not write %zu bytes: %s\n", recordSize, strerror(errno));
+    pthread_mutex_unlock(&(capture->lock));
+    return;
+  }
+
+  // Dropping records would make replay diverge, so a full buffer waits for the writer to swap
+  while (capture->activeLength + recordSize > capture->bufferSize) {
+    pthread_cond_signal(&(capture->wake));
+    pthread_cond_wait(&(capture->drained), &(capture->lock));
+  }
+
+  memcpy(capture->active + capture->activeLength, header, CAPTURE_HEADER_SIZE);
+  memcpy(capture->active + capture->activeLength + CAPTURE_HEADER_SIZE, data, length);
+  capture->activeLength += recordSize;
+  // Half full is early enough for the writer to swap before producers run out of room
+  if (capture->activeLength >= capture->bufferSize / 2)
+    pthread_cond_signal(&(capture->wake));
+  pthread_mutex_unlock(&(capture->lock));
+}
+
+int8_t openCaptureFile(FILE * file) {
+  char magic[CAPTURE_MAGIC_SIZE];
+  if (fread(magic, 1, CAPTURE_MAGIC_SIZE, file) != CAPTURE_MAGIC_SIZE || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)
+    return -1;
+  return 0;
+}
+
+int8_t readCaptureRecord(FILE * file, CaptureRecord * record, uint8_t ** data, size_t * capacity) {
+  uint8_t header[CAPTURE_HEADER_SIZE];
+  size_t const headerRead = fread(header, 1, CAPTURE_HEADER_SIZE, file);
+  if (headerRead == 0)
+    return 0;
+  if (headerRead != CAPTURE_HEADER_SIZE)
+    return -1;
+
+  memcpy(&(record->micros), header, 8);
+  memcpy(&(record->connection), header + 8, 4);
+  memcpy(&(record->length), header + 12, 4);
+  record->type = header[16];
+  record->opcode = header[17];
+
+  if (*capacity < (size_t)record->length + 1) {
+    uint8_t * grown = realloc(*data, (size_t)record->length + 1);
+    if (grown == NULL)
+      return -1;
+    *data = grown;
+    *capacity = (size_t)record->length + 1;
+  }
+  if (fread(*data, 1, record->length, file) != record->length)
+    return -1;
+  (*data)[record->length] = '\0';
+  return 1;
+}
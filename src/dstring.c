@@ -3,70 +3,124 @@
 #include <string.h>
 #include <stdlib.h>
 
+static uint8_t isInline(DString const * const str) {
+  return str->capacity <= DSTRING_INLINE_SIZE;
+}
+
+// size counts the terminator
 static int8_t resize(DString * str, size_t size) {
   size_t newCap = str->capacity;
   while (newCap < size)
     newCap = newCap << 1;
+  if (newCap == str->capacity)
+    return 0;
 
-  char * newPtr = realloc(str->string, newCap * sizeof(char));
-  if (newPtr == NULL)
+  char * newPtr;
+  if (isInline(str)) {
+    if ((newPtr = malloc(newCap * sizeof(char))) == NULL)
+      return -1;
+    memcpy(newPtr, str->small, str->length + 1);
+  } else if ((newPtr = realloc(str->heap, newCap * sizeof(char))) == NULL) {
     return -1;
+  }
 
   str->capacity = newCap;
-  str->string = newPtr;
+  str->heap = newPtr;
 
   return 0;
 }
 
 void * dstrinit(DString * str, char const * string, size_t const length) {
-  str->capacity = 1;
-  while (str->capacity <= length) 
-    str->capacity = str->capacity << 1;
-
   str->length = length;
-  if ((str->string = malloc(str->capacity * sizeof(char))) == NULL)
-    return NULL;
+  if (length < DSTRING_INLINE_SIZE) {
+    str->capacity = DSTRING_INLINE_SIZE;
+  } else {
+    str->capacity = 1;
+    while (str->capacity <= length)
+      str->capacity = str->capacity << 1;
+
+    if ((str->heap = malloc(str->capacity * sizeof(char))) == NULL)
+      return NULL;
+  }
 
-  memcpy(str->string, string, length);
-  str->string[str->capacity - 1] = '\0'; //Fail-safe in case string wasn't null terminated
+  char * const data = dstrdata(str);
+  memcpy(data, string, length);
+  data[length] = '\0';
 
   return str;
 }
 
 void dstrfree(DString * str) {
+  if (!isInline(str))
+    free(str->heap);
   str->capacity = 0;
   str->length = 0;
-  free(str->string);
-  str = NULL;
+}
+
+char * dstrdata(DString * str) {
+  return isInline(str) ? str->small : str->heap;
+}
+
+DStringView dstrview(DString const * const str) {
+  DStringView const view = {
+    .string = isInline(str) ? str->small : str->heap,
+    .length = str->length
+  };
+  return view;
+}
+
+DStringView dstrviewof(char const * string, size_t const length) {
+  DStringView const view = {
+    .string = string,
+    .length = length
+  };
+  return view;
 }
 
 int8_t dstrcmp(DString const * const str1, DString const * const str2) {
-  if (str1->length != str2->length)
+  return dstrviewcmp(dstrview(str1), dstrview(str2));
+}
+
+int8_t dstrviewcmp(DStringView const str1, DStringView const str2) {
+  if (str1.length != str2.length)
     return 0;
 
-  size_t const length = str1->length;
-  for (size_t i = 0; i < length; i++)
-    if (str1->string[i] != str2->string[i])
-      return 0;
+  return memcmp(str1.string, str2.string, str1.length) == 0;
+}
+
+uint32_t dstrhash(DStringView const str) {
+  uint8_t const * bytes = (uint8_t const *)str.string;
+  uint32_t hash = 2166136261u;
 
-  return 1;
+  for (size_t i = 0; i < str.length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619;
+  }
+
+  return hash;
 }
 
 DString * dstrcat(DString * dest, DString const * const src) {
-  size_t newSize = dest->length + src->length - 1; //-1 because of the duplicate '\0'
-  if (dest->capacity < newSize)
-    if (resize(dest, newSize) == -1)
-      return NULL;
+  size_t const newLength = dest->length + src->length;
+  if (resize(dest, newLength + 1) == -1)
+    return NULL;
 
-  memcpy(dest->string + dest->length - 1, src->string, src->length);
+  DStringView const from = dstrview(src);
+  char * const data = dstrdata(dest);
+  memcpy(data + dest->length, from.string, from.length);
+  data[newLength] = '\0';
+  dest->length = newLength;
   return dest;
 }
 
 DString * dstrcpy(DString * dest, DString const * const src) {
-  if (dest->capacity < src->length)
-    if (resize(dest, src->length) == -1)
-      return NULL;
+  if (resize(dest, src->length + 1) == -1)
+    return NULL;
 
-  memcpy(dest->string, src->string, src->length);
+  DStringView const from = dstrview(src);
+  char * const data = dstrdata(dest);
+  memcpy(data, from.string, from.length);
+  data[from.length] = '\0';
+  dest->length = from.length;
   return dest;
 }
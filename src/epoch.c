@@ -0,0 +1,86 @@
+#include "epoch.h"
+
+#include <string.h>
+
+int8_t initEpochDomain(EpochDomain * domain, uint32_t readerCount) {
+  memset(domain, 0, sizeof(EpochDomain));
+  if (readerCount > EPOCH_MAX_READERS)
+    return -1;
+
+  atomic_init(&(domain->global), EPOCH_OFFLINE + 1);
+  for (uint32_t i = 0; i < EPOCH_MAX_READERS; i++)
+    atomic_init(&(domain->readers[i]), EPOCH_OFFLINE);
+  atomic_init(&(domain->pending), 0);
+  domain->readerCount = readerCount;
+  if (pthread_mutex_init(&(domain->lock), NULL) != 0)
+    return -1;
+  return 0;
+}
+
+void freeEpochDomain(EpochDomain * domain) {
+  EpochRetired * retired = domain->retired;
+  domain->retired = NULL;
+  while (retired != NULL) {
+    EpochRetired * const next = retired->next;
+    retired->release(retired);
+    retired = next;
+  }
+  pthread_mutex_destroy(&(domain->lock));
+}
+
+void epochQuiescent(EpochDomain * domain, uint32_t reader) {
+  atomic_store(&(domain->readers[reader]), atomic_load(&(domain->global)));
+}
+
+void epochOffline(EpochDomain * domain, uint32_t reader) {
+  atomic_store(&(domain->readers[reader]), EPOCH_OFFLINE);
+
+  //Without this, whatever was retired while this reader was online would wait for a write that may never come
+  if (atomic_load(&(domain->pending)) != 0)
+    epochCollect(domain);
+}
+
+void epochRetire(EpochDomain * domain, EpochRetired * retired) {
+  pthread_mutex_lock(&(domain->lock));
+  //Readers that announce the new epoch did so after the object was unpublished, so they can't have seen it
+  retired->epoch = atomic_fetch_add(&(domain->global), 1) + 1;
+  retired->next = domain->retired;
+  domain->retired = retired;
+  atomic_fetch_add(&(domain->pending), 1);
+  pthread_mutex_unlock(&(domain->lock));
+
+  epochCollect(domain);
+}
+
+void epochCollect(EpochDomain * domain) {
+  pthread_mutex_lock(&(domain->lock));
+  uint64_t oldest = UINT64_MAX;
+  for (uint32_t i = 0; i < domain->readerCount; i++) {
+    uint64_t const seen = atomic_load(&(domain->readers[i]));
+    if (seen != EPOCH_OFFLINE && seen < oldest)
+      oldest = seen;
+  }
+
+  EpochRetired * released = NULL;
+  uint32_t releasedCount = 0;
+  EpochRetired ** link = &(domain->retired);
+  while (*link != NULL) {
+    EpochRetired * const retired = *link;
+    if (retired->epoch <= oldest) {
+      *link = retired->next;
+      retired->next = released;
+      released = retired;
+      releasedCount++;
+    } else {
+      link = &(retired->next);
+    }
+  }
+  atomic_fetch_sub(&(domain->pending), releasedCount);
+  pthread_mutex_unlock(&(domain->lock));
+
+  while (released != NULL) {
+    EpochRetired * const next = released->next;
+    released->release(released);
+    released = next;
+  }
+}
@@ -28,8 +28,9 @@ static int8_t isNull(uint8_t *bytes, size_t size) {
   return HM_TRUE;
 }
 
-static uint8_t * linearProbing(Map * map, void * entries, void * key, size_t entrySize, size_t capacity) {
-  uint32_t hash = map->hashKey(key, map->key_size);
+static uint8_t * linearProbing(Map * map, void * entries, void * key, size_t entrySize, size_t capacity,
+    int8_t (*cmp)(void const * key1, void const  * key2), uint32_t (*hashKey)(void * key, size_t length)) {
+  uint32_t hash = hashKey(key, map->key_size);
   uint32_t index = hash % capacity;
   uint8_t * tombstone = NULL;
 
@@ -45,7 +46,7 @@ static uint8_t * linearProbing(Map * map, void * entries, void * key, size_t ent
           tombstone = entry;
         }
       }
-    } else if (map->cmp(entry, key)) {
+    } else if (cmp(entry, key)) {
       return entry;
     }
 
@@ -72,7 +73,7 @@ static int8_t resizeArray(Map * map) {
 
     if (isNull(key, map->key_size)) continue;
 
-    uint8_t * dest = linearProbing(map, newEntries, key, entrySize, newCapacity);
+    uint8_t * dest = linearProbing(map, newEntries, key, entrySize, newCapacity, map->cmp, map->hashKey);
 
     memcpy(dest, key, map->key_size);
     memcpy(dest + map->key_size, value, map->value_size);
@@ -108,7 +109,7 @@ int8_t mapPut(Map * map, void * key, void * value) {
   if (map->count >= map->capacity * HM_MAX_LOAD)
     resizeArray(map);
 
-  uint8_t * entry = linearProbing(map, map->entries, key, (map->key_size + map->value_size), map->capacity);
+  uint8_t * entry = linearProbing(map, map->entries, key, (map->key_size + map->value_size), map->capacity, map->cmp, map->hashKey);
 
   int8_t isNewKey = isNull(entry, map->key_size);
   if (isNewKey && isNull(entry + map->key_size, map->value_size))
@@ -123,7 +124,7 @@ int8_t mapPut(Map * map, void * key, void * value) {
 void mapRemove(Map * map, void * key) {
   if (map->count == 0) return;
 
-  uint8_t * entry = linearProbing(map, map->entries, key, (map->key_size + map->value_size), map->capacity);
+  uint8_t * entry = linearProbing(map, map->entries, key, (map->key_size + map->value_size), map->capacity, map->cmp, map->hashKey);
 
   memset(entry, 0, map->key_size);
 
@@ -134,9 +135,13 @@ void mapRemove(Map * map, void * key) {
 }
 
 void * mapGet(Map * map, void * key) {
+  return mapGetAs(map, key, map->cmp, map->hashKey);
+}
+
+void * mapGetAs(Map * map, void * key, int8_t (*cmp)(void const * key1, void const  * key2), uint32_t (*hash)(void * key, size_t length)) {
   if (map->capacity == 0) return NULL;
 
-  uint8_t * entry = linearProbing(map, map->entries, key, (map->key_size + map->value_size), map->capacity);
+  uint8_t * entry = linearProbing(map, map->entries, key, (map->key_size + map->value_size), map->capacity, cmp, hash);
 
   if (isNull(entry, map->key_size)) 
     return NULL;
@@ -0,0 +1,276 @@
+#include "taskpool.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TP_DEQUE_INITIAL 64
+#define TP_STRAND_BATCH 16
+
+typedef struct {
+  TaskPool * pool;
+  uint8_t index;
+} PoolThreadArgs;
+
+static __thread TaskPool * currentPool = NULL;
+static __thread int32_t currentQueue = -1;
+
+static int8_t dequeGrow(TaskDeque * deque) {
+  uint32_t newCapacity = (deque->capacity == 0) ? TP_DEQUE_INITIAL : deque->capacity << 1;
+  Task ** newTasks = malloc(newCapacity * sizeof(Task *));
+  if (newTasks == NULL)
+    return -1;
+
+  for (uint32_t i = 0; i < deque->count; i++)
+    newTasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+
+  free(deque->tasks);
+  deque->tasks = newTasks;
+  deque->head = 0;
+  deque->capacity = newCapacity;
+  return 0;
+}
+
+// Leaves keepFree slots empty afterwards, so the strand runners they were reserved for still fit
+static int8_t dequePush(TaskDeque * deque, Task * task, uint32_t keepFree) {
+  pthread_mutex_lock(&(deque->lock));
+  while (deque->count + keepFree >= deque->capacity) {
+    if (dequeGrow(deque) == -1) {
+      pthread_mutex_unlock(&(deque->lock));
+      return -1;
+    }
+  }
+  deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+  deque->count++;
+  pthread_mutex_unlock(&(deque->lock));
+  return 0;
+}
+
+//Owner end, newest task first so it runs while its data is still in cache
+static Task * dequePop(TaskDeque * deque) {
+  Task * task = NULL;
+  pthread_mutex_lock(&(deque->lock));
+  if (deque->count > 0) {
+    deque->count--;
+    task = deque->tasks[(deque->head + deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&(deque->lock));
+  return task;
+}
+
+//Thief end, oldest task first
+static Task * dequeSteal(TaskDeque * deque) {
+  Task * task = NULL;
+  if (pthread_mutex_trylock(&(deque->lock)) != 0)
+    return NULL;
+  if (deque->count > 0) {
+    task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&(deque->lock));
+  return task;
+}
+
+static Task * findTask(TaskPool * pool, uint8_t index) {
+  Task * task;
+  if ((task = dequePop(&(pool->queues[index]))) != NULL)
+    return task;
+
+  for (uint8_t i = 1; i < pool->threadCount; i++)
+    if ((task = dequeSteal(&(pool->queues[(index + i) % pool->threadCount]))) != NULL)
+      return task;
+
+  return NULL;
+}
+
+static void * poolThreadLoop(void * args) {
+  PoolThreadArgs threadArgs = *(PoolThreadArgs *)args;
+  free(args);
+
+  TaskPool * pool = threadArgs.pool;
+  currentPool = pool;
+  currentQueue = threadArgs.index;
+
+  for (;;) {
+    Task * task = findTask(pool, threadArgs.index);
+    if (task != NULL) {
+      atomic_fetch_sub(&(pool->pending), 1);
+      task->run(task);
+      continue;
+    }
+
+    pthread_mutex_lock(&(pool->idleLock));
+    while (atomic_load(&(pool->pending)) == 0 && !pool->stopping)
+      pthread_cond_wait(&(pool->idleCond), &(pool->idleLock));
+    uint8_t stopping = pool->stopping;
+    pthread_mutex_unlock(&(pool->idleLock));
+
+    //A stopping pool still runs what was queued before it, tasks may be holding memory or owe a final callback
+    if (stopping && atomic_load(&(pool->pending)) == 0)
+      break;
+  }
+
+  return NULL;
+}
+
+static int8_t poolPush(TaskPool * pool, Task * task, uint8_t isReserved) {
+  uint32_t index;
+  if (currentPool == pool)
+    index = currentQueue;
+  else
+    index = atomic_fetch_add(&(pool->nextQueue), 1) % pool->threadCount;
+
+  //Counted first, a thread could otherwise take the task and decrement pending below zero
+  atomic_fetch_add(&(pool->pending), 1);
+  if (dequePush(&(pool->queues[index]), task, isReserved ? 0 : atomic_load(&(pool->reserved))) == -1) {
+    atomic_fetch_sub(&(pool->pending), 1);
+    return -1;
+  }
+
+  pthread_mutex_lock(&(pool->idleLock));
+  pthread_cond_signal(&(pool->idleCond));
+  pthread_mutex_unlock(&(pool->idleLock));
+  return 0;
+}
+
+//Every queue gets room for one more strand runner, a strand is queued in at most one place at a time so its pushes never fail
+static int8_t poolReserve(TaskPool * pool) {
+  uint32_t const reserved = atomic_fetch_add(&(pool->reserved), 1) + 1;
+  for (uint8_t i = 0; i < pool->threadCount; i++) {
+    TaskDeque * const deque = &(pool->queues[i]);
+    pthread_mutex_lock(&(deque->lock));
+    while (deque->count + reserved > deque->capacity) {
+      if (dequeGrow(deque) == -1) {
+        pthread_mutex_unlock(&(deque->lock));
+        atomic_fetch_sub(&(pool->reserved), 1);
+        return -1;
+      }
+    }
+    pthread_mutex_unlock(&(deque->lock));
+  }
+  return 0;
+}
+
+static void strandRun(Task * runner) {
+  TaskStrand * strand = (TaskStrand *)((char *)runner - offsetof(TaskStrand, runner));
+
+  for (uint32_t ran = 0;; ran++) {
+    pthread_mutex_lock(&(strand->lock));
+    if (ran == TP_STRAND_BATCH && strand->head != NULL) {
+      //Let other strands have a go, we are still scheduled so ordering holds
+      pthread_mutex_unlock(&(strand->lock));
+      poolPush(strand->pool, &(strand->runner), 1);
+      return;
+    }
+
+    Task * task = strand->head;
+    if (task == NULL) {
+      strand->scheduled = 0;
+      pthread_mutex_unlock(&(strand->lock));
+      return;
+    }
+    strand->head = task->next;
+    if (strand->head == NULL)
+      strand->tail = NULL;
+    pthread_mutex_unlock(&(strand->lock));
+
+    uint8_t const isFinal = task->isFinal;
+    task->run(task);
+    if (isFinal)
+      return;
+  }
+}
+
+int8_t initTaskPool(TaskPool * pool, uint8_t threadCount) {
+  memset(pool, 0, sizeof(TaskPool));
+  if (threadCount == 0 || threadCount > TASK_POOL_MAX_THREADS)
+    return -1;
+
+  pthread_mutex_init(&(pool->idleLock), NULL);
+  pthread_cond_init(&(pool->idleCond), NULL);
+  for (uint8_t i = 0; i < TASK_POOL_MAX_THREADS; i++)
+    pthread_mutex_init(&(pool->queues[i].lock), NULL);
+
+  for (uint8_t i = 0; i < threadCount; i++) {
+    PoolThreadArgs * args = malloc(sizeof(PoolThreadArgs));
+    if (args == NULL)
+      goto freePool;
+    args->pool = pool;
+    args->index = i;
+
+    if (pthread_create(&(pool->threads[i]), NULL, poolThreadLoop, args) != 0) {
+      free(args);
+      goto freePool;
+    }
+    pool->threadCount++;
+  }
+
+  return 0;
+
+  freePool:
+    freeTaskPool(pool);
+    return -1;
+}
+
+void stopTaskPool(TaskPool * pool) {
+  pthread_mutex_lock(&(pool->idleLock));
+  pool->stopping = 1;
+  pthread_cond_broadcast(&(pool->idleCond));
+  pthread_mutex_unlock(&(pool->idleLock));
+
+  for (uint8_t i = 0; i < pool->threadCount; i++)
+    pthread_join(pool->threads[i], NULL);
+  pool->threadCount = 0;
+}
+
+void freeTaskPool(TaskPool * pool) {
+  stopTaskPool(pool);
+
+  for (uint8_t i = 0; i < TASK_POOL_MAX_THREADS; i++) {
+    free(pool->queues[i].tasks);
+    pthread_mutex_destroy(&(pool->queues[i].lock));
+  }
+  pthread_mutex_destroy(&(pool->idleLock));
+  pthread_cond_destroy(&(pool->idleCond));
+
+  memset(pool, 0, sizeof(TaskPool));
+}
+
+int8_t taskPoolSubmit(TaskPool * pool, Task * task) {
+  return poolPush(pool, task, 0);
+}
+
+int8_t initTaskStrand(TaskStrand * strand, TaskPool * pool) {
+  memset(strand, 0, sizeof(TaskStrand));
+  if (poolReserve(pool) == -1)
+    return -1;
+  pthread_mutex_init(&(strand->lock), NULL);
+  strand->runner.run = strandRun;
+  strand->pool = pool;
+  return 0;
+}
+
+void freeTaskStrand(TaskStrand * strand) {
+  atomic_fetch_sub(&(strand->pool->reserved), 1);
+  pthread_mutex_destroy(&(strand->lock));
+  memset(strand, 0, sizeof(TaskStrand));
+}
+
+void taskStrandPost(TaskStrand * strand, Task * task) {
+  task->next = NULL;
+
+  pthread_mutex_lock(&(strand->lock));
+  if (strand->tail != NULL)
+    strand->tail->next = task;
+  else
+    strand->head = task;
+  strand->tail = task;
+
+  uint8_t const needsSchedule = !strand->scheduled;
+  strand->scheduled = 1;
+  pthread_mutex_unlock(&(strand->lock));
+
+  if (needsSchedule)
+    poolPush(strand->pool, &(strand->runner), 1);
+}
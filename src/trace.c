@@ -0,0 +1,108 @@
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static char const * const stageNames[TRACE_STAGES] = {"kernel queue", "epoll wakeup", "decode", "onMessage", "send"};
+
+uint64_t traceNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint8_t bucketOf(uint64_t nanos) {
+  uint64_t micros = nanos / 1000;
+  uint8_t bucket = 0;
+  while (micros > 0 && bucket < TRACE_BUCKETS - 1) {
+    micros = micros >> 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+int8_t initTraceWriter(TraceWriter * writer, char const * path) {
+  memset(writer, 0, sizeof(TraceWriter));
+  if ((writer->file = fopen(path, "w")) == NULL)
+    return -1;
+
+  pthread_mutex_init(&(writer->lock), NULL);
+  writer->pid = getpid();
+  fputs("[", writer->file);
+  return 0;
+}
+
+void freeTraceWriter(TraceWriter * writer) {
+  if (writer->file == NULL)
+    return;
+
+  fputs("\n]\n", writer->file);
+  fclose(writer->file);
+  pthread_mutex_destroy(&(writer->lock));
+  memset(writer, 0, sizeof(TraceWriter));
+}
+
+void traceRecord(TraceHistograms * histograms, TraceSpan const * span) {
+  histograms->samples++;
+  for (uint8_t stage = 0; stage < TRACE_STAGES; stage++) {
+    uint64_t const start = span->stamps[stage];
+    uint64_t const end = span->stamps[stage + 1];
+    if (start == 0 || end == 0 || end < start)
+      continue;
+    histograms->counts[stage][bucketOf(end - start)]++;
+    histograms->totalNanos[stage] += end - start;
+  }
+}
+
+void traceWriteSpan(TraceWriter * writer, TraceSpan const * span, uint32_t thread) {
+  pthread_mutex_lock(&(writer->lock));
+  for (uint8_t stage = 0; stage < TRACE_STAGES; stage++) {
+    uint64_t const start = span->stamps[stage];
+    uint64_t const end = span->stamps[stage + 1];
+    if (start == 0 || end == 0 || end < start)
+      continue;
+    fprintf(writer->file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"fd\":%d}}",
+        writer->hasEvents ? "," : "", stageNames[stage], start / 1e3, (end - start) / 1e3, writer->pid, thread, span->connection);
+    writer->hasEvents = 1;
+  }
+  pthread_mutex_unlock(&(writer->lock));
+}
+
+void traceMergeHistograms(TraceHistograms * into, TraceHistograms const * from) {
+  into->samples += from->samples;
+  for (uint8_t stage = 0; stage < TRACE_STAGES; stage++) {
+    into->totalNanos[stage] += from->totalNanos[stage];
+    for (uint8_t bucket = 0; bucket < TRACE_BUCKETS; bucket++)
+      into->counts[stage][bucket] += from->counts[stage][bucket];
+  }
+}
+
+static uint64_t percentileMicros(uint64_t const counts[TRACE_BUCKETS], uint64_t total, double percentile) {
+  uint64_t const target = (uint64_t)(total * percentile);
+  uint64_t seen = 0;
+  for (uint8_t bucket = 0; bucket < TRACE_BUCKETS; bucket++) {
+    seen += counts[bucket];
+    if (seen > target)
+      return (uint64_t)1 << bucket;
+  }
+  return (uint64_t)1 << (TRACE_BUCKETS - 1);
+}
+
+void traceWriteHistograms(TraceHistograms const * histograms, FILE * out) {
+  fprintf(out, "%lu sampled messages\n", (unsigned long)histograms->samples);
+  for (uint8_t stage = 0; stage < TRACE_STAGES; stage++) {
+    uint64_t total = 0;
+    for (uint8_t bucket = 0; bucket < TRACE_BUCKETS; bucket++)
+      total += histograms->counts[stage][bucket];
+    if (total == 0) {
+      fprintf(out, "  %-14s no samples\n", stageNames[stage]);
+      continue;
+    }
+    fprintf(out, "  %-14s n=%-8lu mean=%.1fus p50<%luus p90<%luus p99<%luus\n", stageNames[stage], (unsigned long)total,
+        histograms->totalNanos[stage] / 1e3 / total,
+        (unsigned long)percentileMicros(histograms->counts[stage], total, 0.5),
+        (unsigned long)percentileMicros(histograms->counts[stage], total, 0.9),
+        (unsigned long)percentileMicros(histograms->counts[stage], total, 0.99));
+  }
+}
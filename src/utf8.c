@@ -0,0 +1,318 @@
+#include "utf8.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF8_HAS_X86 1
+#endif
+
+// Error classes of the lookup table validator (Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte")
+#define UTF8_TOO_SHORT (1 << 0)
+#define UTF8_TOO_LONG (1 << 1)
+#define UTF8_OVERLONG_3 (1 << 2)
+#define UTF8_TOO_LARGE (1 << 3)
+#define UTF8_SURROGATE (1 << 4)
+#define UTF8_OVERLONG_2 (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+#define UTF8_TWO_CONTS (1 << 7)
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#ifdef UTF8_HAS_X86
+// Indexed by the high nibble of the previous byte
+static const uint8_t byte1HighTable[16] = {
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+  UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+// Indexed by the low nibble of the previous byte
+static const uint8_t byte1LowTable[16] = {
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+  UTF8_CARRY | UTF8_OVERLONG_2,
+  UTF8_CARRY,
+  UTF8_CARRY,
+  UTF8_CARRY | UTF8_TOO_LARGE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+// Indexed by the high nibble of the current byte
+static const uint8_t byte2HighTable[16] = {
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+// A block ending in any of these still waits for continuation bytes
+static const uint8_t incompleteTable[32] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+__attribute__((target("sse4.1")))
+static uint8_t validateSSE(uint8_t const * data, size_t length) {
+  __m128i const table1 = _mm_loadu_si128((__m128i const *)byte1HighTable);
+  __m128i const table2 = _mm_loadu_si128((__m128i const *)byte1LowTable);
+  __m128i const table3 = _mm_loadu_si128((__m128i const *)byte2HighTable);
+  __m128i const maxValue = _mm_loadu_si128((__m128i const *)(incompleteTable + 16));
+  __m128i const lowNibble = _mm_set1_epi8(0x0F);
+  __m128i const thirdByte = _mm_set1_epi8((char)(0xE0 - 0x80));
+  __m128i const fourthByte = _mm_set1_epi8((char)(0xF0 - 0x80));
+  __m128i const highBit = _mm_set1_epi8((char)0x80);
+
+  __m128i error = _mm_setzero_si128();
+  __m128i prevInput = _mm_setzero_si128();
+  __m128i prevIncomplete = _mm_setzero_si128();
+
+  uint8_t tail[16];
+  for (size_t i = 0; i < length; i += 16) {
+    __m128i input;
+    if (i + 16 <= length) {
+      input = _mm_loadu_si128((__m128i const *)(data + i));
+    } else {
+      // Zero padding is ASCII, it cannot hide or cause an error
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, data + i, length - i);
+      input = _mm_loadu_si128((__m128i const *)tail);
+    }
+
+    if (_mm_movemask_epi8(input) == 0) {
+      error = _mm_or_si128(error, prevIncomplete);
+      prevIncomplete = _mm_setzero_si128();
+      prevInput = input;
+      continue;
+    }
+
+    __m128i const prev1 = _mm_alignr_epi8(input, prevInput, 15);
+    __m128i const byte1High = _mm_shuffle_epi8(table1, _mm_and_si128(_mm_srli_epi16(prev1, 4), lowNibble));
+    __m128i const byte1Low = _mm_shuffle_epi8(table2, _mm_and_si128(prev1, lowNibble));
+    __m128i const byte2High = _mm_shuffle_epi8(table3, _mm_and_si128(_mm_srli_epi16(input, 4), lowNibble));
+    __m128i const special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+    __m128i const prev2 = _mm_alignr_epi8(input, prevInput, 14);
+    __m128i const prev3 = _mm_alignr_epi8(input, prevInput, 13);
+    __m128i const must23 = _mm_or_si128(_mm_subs_epu8(prev2, thirdByte), _mm_subs_epu8(prev3, fourthByte));
+    error = _mm_or_si128(error, _mm_xor_si128(_mm_and_si128(must23, highBit), special));
+
+    prevIncomplete = _mm_subs_epu8(input, maxValue);
+    prevInput = input;
+  }
+
+  error = _mm_or_si128(error, prevIncomplete);
+  return _mm_testz_si128(error, error);
+}
+
+#define UTF8_PREV_AVX2(input, prevInput, n) \
+  _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prevInput, input, 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static uint8_t validateAVX2(uint8_t const * data, size_t length) {
+  __m256i const table1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)byte1HighTable));
+  __m256i const table2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)byte1LowTable));
+  __m256i const table3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)byte2HighTable));
+  __m256i const maxValue = _mm256_loadu_si256((__m256i const *)incompleteTable);
+  __m256i const lowNibble = _mm256_set1_epi8(0x0F);
+  __m256i const thirdByte = _mm256_set1_epi8((char)(0xE0 - 0x80));
+  __m256i const fourthByte = _mm256_set1_epi8((char)(0xF0 - 0x80));
+  __m256i const highBit = _mm256_set1_epi8((char)0x80);
+
+  __m256i error = _mm256_setzero_si256();
+  __m256i prevInput = _mm256_setzero_si256();
+  __m256i prevIncomplete = _mm256_setzero_si256();
+
+  uint8_t tail[32];
+  for (size_t i = 0; i < length; i += 32) {
+    __m256i input;
+    if (i + 32 <= length) {
+      input = _mm256_loadu_si256((__m256i const *)(data + i));
+    } else {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, data + i, length - i);
+      input = _mm256_loadu_si256((__m256i const *)tail);
+    }
+
+    if (_mm256_movemask_epi8(input) == 0) {
+      error = _mm256_or_si256(error, prevIncomplete);
+      prevIncomplete = _mm256_setzero_si256();
+      prevInput = input;
+      continue;
+    }
+
+    __m256i const prev1 = UTF8_PREV_AVX2(input, prevInput, 1);
+    __m256i const byte1High = _mm256_shuffle_epi8(table1, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble));
+    __m256i const byte1Low = _mm256_shuffle_epi8(table2, _mm256_and_si256(prev1, lowNibble));
+    __m256i const byte2High = _mm256_shuffle_epi8(table3, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble));
+    __m256i const special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    __m256i const prev2 = UTF8_PREV_AVX2(input, prevInput, 2);
+    __m256i const prev3 = UTF8_PREV_AVX2(input, prevInput, 3);
+    __m256i const must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, thirdByte), _mm256_subs_epu8(prev3, fourthByte));
+    error = _mm256_or_si256(error, _mm256_xor_si256(_mm256_and_si256(must23, highBit), special));
+
+    prevIncomplete = _mm256_subs_epu8(input, maxValue);
+    prevInput = input;
+  }
+
+  error = _mm256_or_si256(error, prevIncomplete);
+  return _mm256_testz_si256(error, error);
+}
+#endif
+
+static uint8_t sequenceLength(uint8_t const lead) {
+  if (lead < 0x80) return 1;
+  if (lead < 0xC0) return 0; // Continuation byte, not a lead
+  if (lead < 0xE0) return 2;
+  if (lead < 0xF0) return 3;
+  if (lead < 0xF8) return 4;
+  return 0;
+}
+
+uint8_t utf8ValidateScalar(uint8_t const * data, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    if (i + 8 <= length) {
+      uint64_t word;
+      memcpy(&word, data + i, sizeof(word));
+      if ((word & 0x8080808080808080ull) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+
+    uint8_t const lead = data[i];
+    if (lead < 0x80) {
+      i++;
+      continue;
+    }
+
+    // Second byte range per RFC 3629 section 4, rules out overlongs, surrogates and code points past U+10FFFF
+    size_t needed;
+    uint8_t low = 0x80, high = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+      needed = 1;
+    } else if (lead == 0xE0) {
+      needed = 2;
+      low = 0xA0;
+    } else if (lead == 0xED) {
+      needed = 2;
+      high = 0x9F;
+    } else if (lead >= 0xE1 && lead <= 0xEF) {
+      needed = 2;
+    } else if (lead == 0xF0) {
+      needed = 3;
+      low = 0x90;
+    } else if (lead >= 0xF1 && lead <= 0xF3) {
+      needed = 3;
+    } else if (lead == 0xF4) {
+      needed = 3;
+      high = 0x8F;
+    } else {
+      return 0;
+    }
+
+    if (i + needed >= length)
+      return 0;
+    if (data[i + 1] < low || data[i + 1] > high)
+      return 0;
+    for (size_t k = 2; k <= needed; k++)
+      if ((data[i + k] & 0xC0) != 0x80)
+        return 0;
+
+    i += needed + 1;
+  }
+
+  return 1;
+}
+
+static uint8_t (*selectValidator(void))(uint8_t const *, size_t) {
+#ifdef UTF8_HAS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return validateAVX2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return validateSSE;
+#endif
+  return utf8ValidateScalar;
+}
+
+uint8_t utf8Validate(uint8_t const * data, size_t length) {
+  static uint8_t (*validator)(uint8_t const *, size_t) = NULL;
+  if (validator == NULL)
+    validator = selectValidator();
+
+  // Short payloads never amortize the vector setup
+  if (length < 16)
+    return utf8ValidateScalar(data, length);
+  return validator(data, length);
+}
+
+void utf8Init(UTF8State * state) {
+  memset(state, 0, sizeof(UTF8State));
+}
+
+int8_t utf8Update(UTF8State * state, uint8_t const * data, size_t length) {
+  if (state->isInvalid)
+    return -1;
+
+  if (state->pendingLength > 0) {
+    uint8_t const total = sequenceLength(state->pending[0]);
+    while (state->pendingLength < total && length > 0) {
+      if ((*data & 0xC0) != 0x80)
+        goto invalid;
+      state->pending[state->pendingLength++] = *(data++);
+      length--;
+    }
+    if (state->pendingLength < total)
+      return 0;
+    if (!utf8ValidateScalar(state->pending, total))
+      goto invalid;
+    state->pendingLength = 0;
+  }
+
+  // Hold back a trailing code point that continues in the next fragment
+  size_t tail = 0;
+  for (size_t back = 1; back <= 3 && back <= length; back++) {
+    uint8_t const byte = data[length - back];
+    if ((byte & 0xC0) == 0x80)
+      continue;
+    if (sequenceLength(byte) > back)
+      tail = back;
+    break;
+  }
+
+  if (!utf8Validate(data, length - tail))
+    goto invalid;
+
+  memcpy(state->pending, data + length - tail, tail);
+  state->pendingLength = tail;
+  return 0;
+
+  invalid:
+    state->isInvalid = 1;
+    return -1;
+}
+
+int8_t utf8Finish(UTF8State * state) {
+  if (state->isInvalid || state->pendingLength > 0)
+    return -1;
+  return 0;
+}
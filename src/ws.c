@@ -2,27 +2,70 @@
 #include <sys/socket.h>
 
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
 #include <openssl/sha.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "arena.h"
 #include "base64.h"
+#include "bus.h"
+#include "capture.h"
 #include "hashmap.h"
 #include "dstring.h"
+#include "epoch.h"
+#include "taskpool.h"
+#include "trace.h"
+#include "utf8.h"
 #include "ws.h"
 
 #define WS_BUFFER_SML 128
 #define WS_BUFFER_BIG 1024
 #define WS_SOCKET_BACKLOG 32
+#define WS_ACCEPT_BUDGET 64
+#define WS_HANDSHAKE_TIMEOUT_MS 10000
+#define WS_ADMISSION_BUCKETS 4096
 #define WS_EVENTS_PER_LOOP 32
+#define WS_FLUSH_IOVECS 64
+#define WS_COALESCE_MAX_BYTES (64 * 1024)
+#define WS_STREAM_CHUNK_SIZE (1024 * 1024)
+#define WS_COALESCE_MAX_DELAY_US 200
+#define WS_REPLY_ARENA_CHUNK (64 * 1024)
+#define WS_SESSION_ARENA_CHUNK 1024
+#define WS_BUS_CAPACITY (4 * 1024 * 1024)
+#define WS_READ_BUFFER_SIZE (64 * 1024)
+#define WS_READ_BUFFER_MIN 1024
+#define WS_KEEP_OUT_FRAMES 4
+#define WS_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+#define WS_CAPTURE_BUFFER (1024 * 1024)
+#define WS_TRACE_STALE_NS 1000000000ull // A sampled message with no outcome by then is dropped
+#define WS_FRAME_PREFIX_MAX (WS_FRAME_HEADER_MAX + 4) // Longest client frame header, mask included
+#define WS_ADDRSTRLEN (sizeof(((struct sockaddr_un *)0)->sun_path) + 6)
 #define WS_SPECIAL_KEY "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
 #define WS_FIN_BIT_END 0x80
+#define WS_OPCODE_CONTINUATION 0x00
 #define WS_OPCODE_TEXT 0x01
+#define WS_OPCODE_BINARY 0x02
 #define WS_OPCODE_CLOSE 0x08
 #define WS_OPCODE_PING 0x09
 #define WS_OPCODE_PONG 0x0A
@@ -31,87 +74,832 @@
 
 WSConnection const nullConn = {0};
 
+static void formatAddress(struct sockaddr_storage const * const addrInfo, socklen_t const addrLength, char * const out) {
+  switch (addrInfo->ss_family) {
+    case AF_INET:
+      inet_ntop(AF_INET, &(((struct sockaddr_in const *)addrInfo)->sin_addr), out, WS_ADDRSTRLEN);
+      break;
+    case AF_INET6:
+      inet_ntop(AF_INET6, &(((struct sockaddr_in6 const *)addrInfo)->sin6_addr), out, WS_ADDRSTRLEN);
+      break;
+    case AF_UNIX:;
+      struct sockaddr_un const * const unixAddr = (struct sockaddr_un const *)addrInfo;
+      if (addrLength <= offsetof(struct sockaddr_un, sun_path))
+        strcpy(out, "unix");
+      else if (unixAddr->sun_path[0] == '\0')
+        snprintf(out, WS_ADDRSTRLEN, "unix:@%.*s", (int)(addrLength - offsetof(struct sockaddr_un, sun_path) - 1), unixAddr->sun_path + 1);
+      else
+        snprintf(out, WS_ADDRSTRLEN, "unix:%s", unixAddr->sun_path);
+      break;
+    default:
+      strcpy(out, "unknown");
+      break;
+  }
+}
+
+enum WSTaskKind {
+  WS_TASK_HANDSHAKE,
+  WS_TASK_MESSAGE,
+  WS_TASK_REPLY,
+  WS_TASK_DISCONNECT,
+  WS_TASK_BROADCAST,
+  WS_TASK_STREAM,
+  WS_TASK_BATCH,
+  WS_TASK_PONG
+};
+
+struct WSHandlerTask {
+  Task task;
+  WSWorker * worker;
+  WSConnection * client;
+  uint64_t routeID; // Broadcasts only, they are not tied to one client
+  uint8_t kind;
+  uint16_t closeCode;
+  char * data;
+  size_t size;
+  WSHandlerTask * nextCompletion;
+};
+
+// One copy of a bus record for the whole process, every worker's task lives in it and the last one retired frees it
+typedef struct {
+  WSHandlerTask tasks[WS_MAX_THREADS];
+  atomic_uint references;
+  char payload[];
+} WSBroadcast;
+
+static void releaseBroadcast(WSHandlerTask * const handlerTask) {
+  WSBroadcast * const broadcast = (WSBroadcast *)(handlerTask->data - offsetof(WSBroadcast, payload));
+  if (atomic_fetch_sub(&(broadcast->references), 1) == 1)
+    free(broadcast);
+}
+
+// Where getReplyBuffer/commitReply send things for the handler running on this thread
+typedef struct {
+  WSWorker * worker;
+  WSConnection * client;
+  uint8_t isPooled;
+  char * reserved;
+  size_t reservedSize;
+  WSStream * finished; // Streams that completed while the handler was running, newest first
+} WSReplySink;
+
+static __thread WSReplySink replySink;
+
 static int8_t comparePaths(void const * key1_dstr, void const * key2_dstr) {
   return dstrcmp((DString const *)key1_dstr, (DString const *)key2_dstr);
 }
 
+// Stored path against a DStringView, for lookups straight from request bytes
+static int8_t comparePathView(void const * key_dstr, void const * key_view) {
+  return dstrviewcmp(dstrview((DString const *)key_dstr), *(DStringView const *)key_view);
+}
+
 static uint32_t hashString(void * key, size_t length) {
   (void)length; // unused
 
-  uint8_t * bytes = (uint8_t *)((DString *)key)->string;
-  uint32_t hash = 2166136261u;
+  return dstrhash(dstrview((DString const *)key));
+}
+
+static uint32_t hashView(void * key, size_t length) {
+  (void)length; // unused
+
+  return dstrhash(*(DStringView const *)key);
+}
+
+#define WS_ACCEPT_READER WS_MAX_THREADS // Epoch reader index of the accept loop, workers use their own index
+
+typedef struct {
+  WSRouteTable * routes;
+  DStringView const * skip;
+  uint8_t skipped;
+  int8_t result;
+} WSRouteCopy;
+
+// Only between two quiescent points of the calling reader, or with routeLock held
+static WSPathHandler * findPath(WSSocket * const socketInfo, DStringView path) {
+  WSRouteTable * const routes = atomic_load(&(socketInfo->routes));
+  WSPathHandler ** const pathHandler = mapGetAs(&(routes->paths), &path, comparePathView, hashView);
+  return (pathHandler == NULL) ? NULL : *pathHandler;
+}
+
+static void releasePathHandler(WSPathHandler * const pathHandler) {
+  if (atomic_fetch_sub(&(pathHandler->references), 1) == 1)
+    free(pathHandler);
+}
+
+static WSRouteTable * newRouteTable(void) {
+  WSRouteTable * const routes = calloc(1, sizeof(WSRouteTable));
+  if (routes != NULL)
+    initMap(&(routes->paths), sizeof(DString), sizeof(WSPathHandler *), comparePaths, hashString);
+  return routes;
+}
+
+static void freeRouteForEachWrapper(void * pathPtr, void * pathHandlerPtr, void * contextPtr) {
+  (void)contextPtr; //unused
+
+  dstrfree(pathPtr);
+  releasePathHandler(*(WSPathHandler **)pathHandlerPtr);
+}
+
+static void freeRouteTable(WSRouteTable * const routes) {
+  mapForEach(&(routes->paths), NULL, freeRouteForEachWrapper);
+  freeMap(&(routes->paths));
+  free(routes);
+}
+
+static void releaseRouteTable(EpochRetired * retired) {
+  freeRouteTable((WSRouteTable *)((char *)retired - offsetof(WSRouteTable, retired)));
+}
+
+static void copyRouteForEachWrapper(void * pathPtr, void * pathHandlerPtr, void * contextPtr) {
+  WSRouteCopy * const copy = contextPtr;
+  DStringView const path = dstrview(pathPtr);
+  if (copy->result == -1)
+    return;
+  if (copy->skip != NULL && dstrviewcmp(path, *(copy->skip))) {
+    copy->skipped = 1;
+    return;
+  }
+
+  DString pathDStr;
+  if (dstrinit(&pathDStr, path.string, path.length) == NULL) {
+    copy->result = -1;
+    return;
+  }
+  WSPathHandler * pathHandler = *(WSPathHandler **)pathHandlerPtr;
+  atomic_fetch_add(&(pathHandler->references), 1);
+  mapPut(&(copy->routes->paths), &pathDStr, &pathHandler);
+}
+
+// Needs routeLock. Returns a private copy of the current table without skip (unless NULL), NULL if out of memory
+static WSRouteTable * copyRoutes(WSSocket * const socketInfo, DStringView const * const skip, uint8_t * const skipped) {
+  WSRouteCopy copy = {
+    .routes = newRouteTable(),
+    .skip = skip
+  };
+  if (copy.routes == NULL)
+    return NULL;
+
+  mapForEach(&(atomic_load(&(socketInfo->routes))->paths), &copy, copyRouteForEachWrapper);
+  if (copy.result == -1) {
+    freeRouteTable(copy.routes);
+    return NULL;
+  }
+  if (skipped != NULL)
+    *skipped = copy.skipped;
+  return copy.routes;
+}
+
+// Needs routeLock. The old table is released once no reader can still be looking at it
+static void publishRoutes(WSSocket * const socketInfo, WSRouteTable * const routes) {
+  WSRouteTable * const old = atomic_exchange(&(socketInfo->routes), routes);
+  old->retired.release = releaseRouteTable;
+  epochRetire(&(socketInfo->routeEpochs), &(old->retired));
+}
+
+static uint64_t monotonicMicros(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t monotonicNanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Options already checked by setBusyPolling, a socket refusing them just runs without
+static void applyBusyPoll(WSBusyPoll const * const busyPoll, int32_t const clientFD) {
+  if (busyPoll->socketBusyPollMicros != 0)
+    setsockopt(clientFD, SOL_SOCKET, SO_BUSY_POLL, &(busyPoll->socketBusyPollMicros), sizeof(busyPoll->socketBusyPollMicros));
+  if (busyPoll->preferBusyPoll) {
+    int32_t const enable = 1;
+    setsockopt(clientFD, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable));
+  }
+}
 
-  for (size_t i = 0; i < ((DString *)key)->length; i++) {
-    hash ^= bytes[i];
-    hash *= 16777619;
+// Answers without reading the request, this has to stay cheaper than the handshake it saves
+static void rejectConnection(int32_t const clientFD, int32_t const code) {
+  static char const tooManyRequests[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  static char const unavailable[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+  if (code == 429)
+    send(clientFD, tooManyRequests, sizeof(tooManyRequests) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+  else
+    send(clientFD, unavailable, sizeof(unavailable) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+  close(clientFD);
+}
+
+// Returns 0 if the connection may go on to the handshake, otherwise the HTTP status to reject it with
+static int32_t admitConnection(WSSocket * const socketInfo, WSConnection const * const client) {
+  WSAdmission const * const admission = &(socketInfo->admission);
+
+  if (admission->maxPendingHandshakes != 0 && atomic_load(&(socketInfo->pendingHandshakes)) >= admission->maxPendingHandshakes)
+    return 503;
+
+  // Local peers (a reverse proxy on a Unix socket) are never rate limited, they speak for everyone behind them
+  if (socketInfo->rateLimits.buckets != NULL && client->addrInfo.ss_family != AF_UNIX) {
+    uint8_t address[ADMISSION_ADDRESS_SIZE] = {0};
+    if (client->addrInfo.ss_family == AF_INET6) {
+      memcpy(address, &(((struct sockaddr_in6 const *)&(client->addrInfo))->sin6_addr), ADMISSION_ADDRESS_SIZE);
+    } else {
+      address[10] = 0xFF;
+      address[11] = 0xFF;
+      memcpy(address + 12, &(((struct sockaddr_in const *)&(client->addrInfo))->sin_addr), 4);
+    }
+    if (!admissionTake(&(socketInfo->rateLimits), address, monotonicMicros()))
+      return 429;
   }
 
-  return hash;
+  return 0;
+}
+
+// Deadlines are taken in the order connections reach the worker, so the list stays sorted by them
+static void startHandshakeDeadline(WSWorker * const worker, WSConnection * const client) {
+  // Only the first EPOLLOUT was wanted, the connection goes back to the usual events
+  struct epoll_event clientEvent = {
+    .data.fd = client->clientFD,
+    .events = EPOLLIN | EPOLLET
+  };
+  epoll_ctl(worker->workerEventPoll, EPOLL_CTL_MOD, client->clientFD, &clientEvent);
+
+  client->handshakeDeadline = monotonicMicros() + (uint64_t)worker->socket->admission.handshakeTimeoutMs * 1000;
+  client->prevHandshake = worker->lastHandshake;
+  client->nextHandshake = -1;
+  if (worker->lastHandshake == -1)
+    worker->firstHandshake = client->clientFD;
+  else
+    worker->socket->connections[worker->lastHandshake].nextHandshake = client->clientFD;
+  worker->lastHandshake = client->clientFD;
 }
 
-static int8_t acceptNewConnection(WSSocket * const socketInfo, WSConnection * const client, uint8_t assignedThread) {
-  socklen_t addrLen = sizeof(struct sockaddr_in);
+// The connection stops counting against maxPendingHandshakes and leaves its worker's deadline list
+static void endPendingHandshake(WSSocket * const socketInfo, WSConnection * const client) {
+  atomic_fetch_sub(&(socketInfo->pendingHandshakes), 1);
+  if (client->handshakeDeadline == 0)
+    return;
+
+  WSWorker * const worker = &(socketInfo->threads[client->assignedThread]);
+  if (client->prevHandshake == -1)
+    worker->firstHandshake = client->nextHandshake;
+  else
+    socketInfo->connections[client->prevHandshake].nextHandshake = client->nextHandshake;
+  if (client->nextHandshake == -1)
+    worker->lastHandshake = client->prevHandshake;
+  else
+    socketInfo->connections[client->nextHandshake].prevHandshake = client->prevHandshake;
+  client->handshakeDeadline = 0;
+}
 
+// Returns 0 on success, 1 if the connection was turned away, -1 if there was nothing to accept
+static int8_t acceptNewConnection(WSSocket * const socketInfo, int32_t const listenerFD, WSConnection * const client, uint8_t assignedThread) {
   memset(client, 0, sizeof(WSConnection));
-  if ((client->clientFD = accept4(socketInfo->socketFD, (struct sockaddr *)&(client->addrInfo), &addrLen, SOCK_NONBLOCK)) == -1) {
-    printf("(Server): New client connection failed: %s\n", strerror(errno));
+  client->addrLength = sizeof(struct sockaddr_storage);
+  if ((client->clientFD = accept4(listenerFD, (struct sockaddr *)&(client->addrInfo), &(client->addrLength), SOCK_NONBLOCK)) == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      printf("(Server): New client connection failed: %s\n", strerror(errno));
     return -1;
   }
-  char addr[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &(client->addrInfo.sin_addr), addr, INET_ADDRSTRLEN);
+
+  // The connection table is indexed by descriptor, one past its end has nowhere to go
+  if (client->clientFD >= WS_MAX_CONNECTIONS) {
+    printf("(Server): Descriptor %d is past the connection table, turning the client away.\n", client->clientFD);
+    rejectConnection(client->clientFD, 503);
+    return 1;
+  }
+
+  int32_t rejection;
+  if ((rejection = admitConnection(socketInfo, client)) != 0) {
+    rejectConnection(client->clientFD, rejection);
+    return 1;
+  }
+
+  applyBusyPoll(&(socketInfo->busyPoll), client->clientFD);
+  if (socketInfo->traceSampleEvery != 0) {
+    int32_t const timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    setsockopt(client->clientFD, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping));
+  }
+
+  char addr[WS_ADDRSTRLEN];
+  formatAddress(&(client->addrInfo), client->addrLength, addr);
   client->needsHandshake = 1;
+  client->assignedThread = assignedThread;
+  initArena(&(client->sessionArena), WS_SESSION_ARENA_CHUNK);
+  atomic_fetch_add(&(socketInfo->pendingHandshakes), 1);
 
+  // The worker may see the first event before epoll_ctl returns, so the connection has to be in place already
+  memcpy(&(socketInfo->connections[client->clientFD]), client, sizeof(WSConnection));
+
+  // A fresh socket is writable, so the worker hears about it (and starts its handshake deadline) even if the client stays silent
   struct epoll_event newClientEvent = {
     .data.fd = client->clientFD,
-    .events = EPOLLIN | EPOLLET
+    .events = EPOLLIN | EPOLLOUT | EPOLLET
   };
   if (epoll_ctl(socketInfo->threads[assignedThread].workerEventPoll, EPOLL_CTL_ADD, client->clientFD, &newClientEvent) == -1) {
     printf("(Server): Could not track event for new client: \"%s\", %s\n", addr, strerror(errno));
+    atomic_fetch_sub(&(socketInfo->pendingHandshakes), 1);
+    memset(&(socketInfo->connections[client->clientFD]), 0, sizeof(WSConnection));
     close(client->clientFD);
     memset(client, 0, sizeof(WSConnection));
+    return 1;
+  }
+
+  printf("(%s): Client connected.\n", addr);
+  return 0;
+}
+
+static uint8_t frameHeaderLength(size_t const size) {
+  if (size <= 125)
+    return 2;
+  if (size <= 65535)
+    return 4;
+  return 10;
+}
+
+static uint8_t writeFrameHeader(uint8_t * const header, uint8_t const opcode, size_t const size) {
+  header[0] = WS_FIN_BIT_END | opcode;
+  if (size <= 125) {
+    header[1] = (uint8_t)size;
+    return 2;
+  }
+  if (size <= 65535) {
+    header[1] = 126;
+    header[2] = (size >> 8) & 0xFF;
+    header[3] = size & 0xFF;
+    return 4;
+  }
+  header[1] = 127;
+  for (uint8_t i = 0; i < 8; i++)
+    header[2 + i] = ((uint64_t)size >> (56 - 8 * i)) & 0xFF;
+  return 10;
+}
+
+static void watchWritable(WSWorker * const worker, WSConnection * const client, int8_t const enable) {
+  if (client->waitsWritable == enable)
+    return;
+
+  struct epoll_event clientEvent = {
+    .data.fd = client->clientFD,
+    .events = EPOLLIN | EPOLLET | (enable ? EPOLLOUT : 0)
+  };
+  if (epoll_ctl(worker->workerEventPoll, EPOLL_CTL_MOD, client->clientFD, &clientEvent) == 0)
+    client->waitsWritable = enable;
+}
+
+static void finishStream(WSConnection * const client, WSStream * const stream) {
+  // A stream can be written out within its own streamFile call, onDone waits for the handler to return
+  if (replySink.client == client) {
+    stream->nextFinished = replySink.finished;
+    replySink.finished = stream;
+    return;
+  }
+
+  if (stream->onDone != NULL)
+    stream->onDone(client, stream->context, stream->isComplete ? 0 : -1);
+  free(stream);
+}
+
+static void dropFrames(WSConnection * const client, uint32_t const count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (client->outFrames[i].ownership == WS_PAYLOAD_OWNED)
+      free(client->outFrames[i].allocation);
+    else if (client->outFrames[i].ownership == WS_PAYLOAD_STREAM)
+      finishStream(client, client->outFrames[i].allocation);
+  }
+
+  client->outCount -= count;
+  // A connection that never queued anything has no outFrames at all
+  if (client->outCount != 0)
+    memmove(client->outFrames, client->outFrames + count, client->outCount * sizeof(WSOutFrame));
+}
+
+// end of 0 leaves the send stage out, for messages that got no reply
+static void finishTraceSpan(WSWorker * const worker, uint64_t const end) {
+  TraceSpan * const span = &(worker->traceSpan);
+  span->stamps[TRACE_STAGES] = end;
+  traceRecord(&(worker->traceHistograms), span);
+  if (worker->socket->traceWriter.file != NULL)
+    traceWriteSpan(&(worker->socket->traceWriter), span, worker - worker->socket->threads);
+  span->isActive = 0;
+}
+
+// Returns 1 once the whole message is written, 0 when the socket buffer is full, -1 if the socket or the file broke
+static int8_t writeStream(WSConnection * const client, WSStream * const stream) {
+  for (;;) {
+    if (stream->chunkLeft == 0 && stream->headerWritten == stream->headerLength) {
+      if (stream->isStarted && stream->sent == stream->length) {
+        stream->isComplete = 1;
+        return 1;
+      }
+
+      size_t chunk = stream->length - stream->sent;
+      if (stream->chunkSize != 0 && chunk > stream->chunkSize)
+        chunk = stream->chunkSize;
+      stream->headerLength = writeFrameHeader(stream->header, stream->isStarted ? WS_OPCODE_CONTINUATION : stream->opcode, chunk);
+      if (stream->sent + chunk < stream->length)
+        stream->header[0] &= ~WS_FIN_BIT_END;
+      stream->headerWritten = 0;
+      stream->chunkLeft = chunk;
+      stream->isStarted = 1;
+    }
+
+    if (stream->headerWritten < stream->headerLength) {
+      ssize_t const written = send(client->clientFD, stream->header + stream->headerWritten, stream->headerLength - stream->headerWritten, MSG_NOSIGNAL | MSG_MORE);
+      if (written == -1)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+      stream->headerWritten += written;
+      continue;
+    }
+
+    ssize_t written;
+    if (stream->fileFD != -1) {
+      off_t offset = stream->fileOffset + stream->sent;
+      written = sendfile(client->clientFD, stream->fileFD, &offset, stream->chunkLeft);
+      if (written == 0) {
+        printf("(Server): Streamed file ended %zu bytes early.\n", stream->length - stream->sent);
+        return -1;
+      }
+    } else {
+      int32_t const more = (stream->sent + stream->chunkLeft < stream->length) ? MSG_MORE : 0;
+      written = send(client->clientFD, stream->region + stream->sent, stream->chunkLeft, MSG_NOSIGNAL | more);
+    }
+    if (written == -1)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    stream->sent += written;
+    stream->chunkLeft -= written;
+  }
+}
+
+// Writes as much of the connection's queue as the socket takes, returns -1 if the socket is broken
+static int8_t flushConnection(WSWorker * const worker, WSConnection * const client) {
+  while (client->outCount > 0) {
+    // A stream writes itself, everything queued behind it waits until the whole message is out
+    if (client->outFrames[0].ownership == WS_PAYLOAD_STREAM) {
+      int8_t const result = writeStream(client, client->outFrames[0].allocation);
+      if (result == 0) {
+        watchWritable(worker, client, 1);
+        return 0;
+      }
+      if (result == -1) {
+        dropFrames(client, client->outCount);
+        client->outBytes = 0;
+        return -1;
+      }
+      dropFrames(client, 1);
+      continue;
+    }
+
+    struct iovec iov[WS_FLUSH_IOVECS];
+    uint32_t iovCount = 0;
+    uint32_t frame = 0;
+    size_t attempted = 0;
+
+    for (; frame < client->outCount && iovCount + 2 <= WS_FLUSH_IOVECS && client->outFrames[frame].ownership != WS_PAYLOAD_STREAM; frame++) {
+      WSOutFrame * const out = &(client->outFrames[frame]);
+      if (out->written < out->headerLength) {
+        iov[iovCount].iov_base = out->header + out->written;
+        iov[iovCount].iov_len = out->headerLength - out->written;
+        attempted += iov[iovCount++].iov_len;
+      }
+      size_t const payloadWritten = (out->written > out->headerLength) ? out->written - out->headerLength : 0;
+      if (out->length > payloadWritten) {
+        iov[iovCount].iov_base = out->payload + payloadWritten;
+        iov[iovCount].iov_len = out->length - payloadWritten;
+        attempted += iov[iovCount++].iov_len;
+      }
+    }
+
+    struct msghdr message = {
+      .msg_iov = iov,
+      .msg_iovlen = iovCount
+    };
+    int32_t const flags = MSG_NOSIGNAL | ((frame < client->outCount) ? MSG_MORE : 0);
+    ssize_t sent = sendmsg(client->clientFD, &message, flags);
+    if (sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        watchWritable(worker, client, 1);
+        return 0;
+      }
+      dropFrames(client, client->outCount);
+      client->outBytes = 0;
+      return -1;
+    }
+
+    if (worker->traceSpan.isActive && worker->traceSpan.connection == client->clientFD && worker->traceSpan.stamps[TRACE_SEND] != 0)
+      finishTraceSpan(worker, traceNow());
+
+    size_t const accepted = sent;
+    client->outBytes -= sent;
+    uint32_t done = 0;
+    while (sent > 0) {
+      WSOutFrame * const out = &(client->outFrames[done]);
+      size_t const left = out->headerLength + out->length - out->written;
+      if ((size_t)sent < left) {
+        out->written += sent;
+        break;
+      }
+      sent -= left;
+      done++;
+    }
+    dropFrames(client, done);
+
+    if (accepted < attempted) {
+      // Short write, the socket buffer is full
+      watchWritable(worker, client, 1);
+      return 0;
+    }
+  }
+
+  // A burst can leave a long queue behind, idle connections go back to the policy's size
+  uint32_t const keepOutFrames = worker->socket->memory.keepOutFrames;
+  if (client->outCapacity > keepOutFrames) {
+    if (keepOutFrames == 0) {
+      free(client->outFrames);
+      client->outFrames = NULL;
+      client->outCapacity = 0;
+    } else {
+      WSOutFrame * const trimmed = realloc(client->outFrames, keepOutFrames * sizeof(WSOutFrame));
+      if (trimmed != NULL) {
+        client->outFrames = trimmed;
+        client->outCapacity = keepOutFrames;
+      }
+    }
+  }
+
+  watchWritable(worker, client, 0);
+  return 0;
+}
+
+// Arena memory is only good until the end of the loop iteration, whatever the socket did not take yet moves to the heap
+static void retainBatchFrames(WSConnection * const client) {
+  for (uint32_t i = 0; i < client->outCount; i++) {
+    WSOutFrame * const out = &(client->outFrames[i]);
+    if (out->ownership != WS_PAYLOAD_BATCH)
+      continue;
+
+    char * copy = malloc(out->length);
+    if (copy == NULL && out->length > 0) {
+      // Can't keep the stream intact past this point
+      printf("(Server): Out of memory holding back a reply, dropping the rest of the queue.\n");
+      dropFrames(client, client->outCount);
+      client->outBytes = 0;
+      shutdown(client->clientFD, SHUT_WR);
+      return;
+    }
+    memcpy(copy, out->payload, out->length);
+    out->payload = copy;
+    out->allocation = copy;
+    out->ownership = WS_PAYLOAD_OWNED;
+  }
+}
+
+static void flushWorker(WSWorker * const worker) {
+  for (uint32_t i = 0; i < worker->queuedCount; i++) {
+    WSConnection * const client = &(worker->socket->connections[worker->queuedFDs[i]]);
+    client->isQueued = 0;
+    if (!client->waitsWritable)
+      flushConnection(worker, client);
+    retainBatchFrames(client);
+  }
+  worker->queuedCount = 0;
+  worker->firstQueuedAt = 0;
+  arenaReset(&(worker->replyArena));
+
+  TraceSpan * const span = &(worker->traceSpan);
+  if (span->isActive) {
+    if (span->stamps[TRACE_SEND] != 0 && worker->socket->connections[span->connection].outCount == 0)
+      finishTraceSpan(worker, 0);
+    else if (traceNow() - span->stamps[TRACE_DECODE] > WS_TRACE_STALE_NS)
+      span->isActive = 0;
+  }
+
+  while (worker->retiredBroadcasts != NULL) {
+    WSHandlerTask * const retired = worker->retiredBroadcasts;
+    worker->retiredBroadcasts = retired->nextCompletion;
+    releaseBroadcast(retired);
+  }
+}
+
+static WSRouteMembers * findRouteMembers(WSWorker * const worker, uint64_t const routeID) {
+  for (uint32_t i = 0; i < worker->routeMemberCount; i++)
+    if (worker->routeMembers[i].first != -1 && worker->routeMembers[i].routeID == routeID)
+      return &(worker->routeMembers[i]);
+  return NULL;
+}
+
+// Broadcasts only go to members, a connection that can not join misses them (delivery is best effort)
+static void joinRoute(WSWorker * const worker, WSConnection * const client) {
+  uint64_t const routeID = client->pathHanlder->routeID;
+  WSRouteMembers * members = findRouteMembers(worker, routeID);
+  for (uint32_t i = 0; members == NULL && i < worker->routeMemberCount; i++)
+    if (worker->routeMembers[i].first == -1)
+      members = &(worker->routeMembers[i]);
+
+  if (members == NULL) {
+    WSRouteMembers * const grown = realloc(worker->routeMembers, (worker->routeMemberCount + 1) * sizeof(WSRouteMembers));
+    if (grown == NULL) {
+      printf("(Server): Could not track connection for broadcasts.\n");
+      return;
+    }
+    worker->routeMembers = grown;
+    members = &(grown[worker->routeMemberCount++]);
+    members->first = -1;
+  }
+  members->routeID = routeID;
+
+  client->isRouteMember = 1;
+  client->prevRouteMember = -1;
+  client->nextRouteMember = members->first;
+  if (members->first != -1)
+    worker->socket->connections[members->first].prevRouteMember = client->clientFD;
+  members->first = client->clientFD;
+}
+
+static void leaveRoute(WSWorker * const worker, WSConnection * const client) {
+  if (!client->isRouteMember)
+    return;
+
+  client->isRouteMember = 0;
+  WSConnection * const connections = worker->socket->connections;
+  if (client->prevRouteMember != -1)
+    connections[client->prevRouteMember].nextRouteMember = client->nextRouteMember;
+  else
+    findRouteMembers(worker, client->pathHanlder->routeID)->first = client->nextRouteMember;
+  if (client->nextRouteMember != -1)
+    connections[client->nextRouteMember].prevRouteMember = client->prevRouteMember;
+}
+
+// A closed connection's descriptor can come back for another worker before this one flushes, so it can't stay queued
+static void unqueueConnection(WSWorker * const worker, WSConnection * const client) {
+  if (!client->isQueued)
+    return;
+
+  client->isQueued = 0;
+  for (uint32_t i = 0; i < worker->queuedCount; i++) {
+    if (worker->queuedFDs[i] == client->clientFD) {
+      worker->queuedFDs[i] = worker->queuedFDs[--(worker->queuedCount)];
+      break;
+    }
+  }
+  if (worker->queuedCount == 0)
+    worker->firstQueuedAt = 0;
+}
+
+static WSOutFrame * reserveFrame(WSConnection * const client) {
+  if (client->outCount == client->outCapacity) {
+    uint32_t newCapacity = (client->outCapacity == 0) ? 4 : client->outCapacity << 1;
+    WSOutFrame * newFrames = realloc(client->outFrames, newCapacity * sizeof(WSOutFrame));
+    if (newFrames == NULL)
+      return NULL;
+    client->outFrames = newFrames;
+    client->outCapacity = newCapacity;
+  }
+
+  WSOutFrame * const out = &(client->outFrames[client->outCount++]);
+  out->written = 0;
+  return out;
+}
+
+static void scheduleFlush(WSWorker * const worker, WSConnection * const client, WSOutFrame const * const out) {
+  client->outBytes += out->headerLength + out->length;
+
+  if (!client->isQueued) {
+    client->isQueued = 1;
+    worker->queuedFDs[worker->queuedCount++] = client->clientFD;
+    if (worker->firstQueuedAt == 0)
+      worker->firstQueuedAt = monotonicMicros();
+  }
+
+  // Big enough batch already, unless we are waiting on EPOLLOUT anyway
+  if (client->outBytes >= worker->socket->coalesceMaxBytes && !client->waitsWritable)
+    flushConnection(worker, client);
+}
+
+// Queues one frame for the end of the loop iteration, an owned payload is free'd even if queueing fails
+static int8_t queueFrame(WSWorker * const worker, WSConnection * const client, uint8_t const opcode, char * const payload, size_t const size, uint8_t const ownership) {
+  WSOutFrame * const out = reserveFrame(client);
+  if (out == NULL) {
+    if (ownership == WS_PAYLOAD_OWNED)
+      free(payload);
     return -1;
   }
-  client->assignedThread = assignedThread;
 
-  memcpy(&(socketInfo->connections[client->clientFD]), client, sizeof(WSConnection));
+  out->headerLength = writeFrameHeader(out->header, opcode, size);
+  out->ownership = ownership;
+  out->payload = payload;
+  out->length = size;
+  out->allocation = payload;
+  scheduleFlush(worker, client, out);
+  return 0;
+}
 
-  printf("(%s): Client connected.\n", addr);
+// Same as queueFrame for a frame whose header is already in front of the payload
+static int8_t queueEncodedFrame(WSWorker * const worker, WSConnection * const client, char * const frame, size_t const length, uint8_t const ownership, void * const allocation) {
+  WSOutFrame * const out = reserveFrame(client);
+  if (out == NULL) {
+    if (ownership == WS_PAYLOAD_OWNED)
+      free(allocation);
+    return -1;
+  }
+
+  out->headerLength = 0;
+  out->ownership = ownership;
+  out->payload = frame;
+  out->length = length;
+  out->allocation = allocation;
+  scheduleFlush(worker, client, out);
+  return 0;
+}
+
+// Queues a streamed message, the stream stays with the caller if queueing fails
+static int8_t queueStream(WSWorker * const worker, WSConnection * const client, WSStream * const stream) {
+  WSOutFrame * const out = reserveFrame(client);
+  if (out == NULL)
+    return -1;
+
+  out->headerLength = 0;
+  out->ownership = WS_PAYLOAD_STREAM;
+  out->payload = NULL;
+  out->length = 0;
+  out->allocation = stream;
+  scheduleFlush(worker, client, out);
   return 0;
 }
 
+// Writes the header into the headroom right before payload, returns where the frame starts
+static char * encodeInPlace(char * const payload, uint8_t const opcode, size_t const size) {
+  uint8_t const headerLength = frameHeaderLength(size);
+  char * const frame = payload - headerLength;
+  writeFrameHeader((uint8_t *)frame, opcode, size);
+  return frame;
+}
+
+// Takes ownership of buffer
+static size_t sendDataTo(WSWorker * const worker, WSConnection * const client, char * const buffer, size_t const size) {
+  if (size == 0) {
+    free(buffer);
+    return 0;
+  }
+
+  if (queueFrame(worker, client, WS_OPCODE_TEXT, buffer, size, WS_PAYLOAD_OWNED) == -1)
+    return 0;
+  return size;
+}
+
 static void sendCloseFrameTo(WSConnection const * const client, uint16_t closeCode) {
-  socklen_t addrLen = sizeof(struct sockaddr_in);
   closeCode = htons(closeCode);
   uint8_t * closeCodeBits = (uint8_t *)(&closeCode);
 
   uint8_t closeFrame[4] = {0x88, 0x2, 0x0, 0x0};
   memcpy(closeFrame + 2, closeCodeBits, 2 * sizeof(uint8_t));
-  sendto(client->clientFD, closeFrame, 4, 0, (struct sockaddr *)&(client->addrInfo), addrLen);
+  send(client->clientFD, closeFrame, 4, MSG_NOSIGNAL);
 }
 
 static void freeConnectionResources(WSSocket * const socketInfo, WSConnection * const client, uint16_t const closeCode) {
-  sendCloseFrameTo(client, closeCode);
+  WSWorker * const worker = &(socketInfo->threads[client->assignedThread]);
+  if (worker->traceSpan.isActive && worker->traceSpan.connection == client->clientFD)
+    worker->traceSpan.isActive = 0;
+
+  // Whatever the socket takes right now goes out before the close frame, the rest is dropped
+  flushConnection(worker, client);
+  dropFrames(client, client->outCount);
+  free(client->outFrames);
+  unqueueConnection(worker, client);
+
+  if (client->needsHandshake)
+    endPendingHandshake(socketInfo, client);
+  else
+    sendCloseFrameTo(client, closeCode);
 
-  free(client->recvBuffer);
-  free(client->sendBuffer);
+  if (client->captureID != 0)
+    captureRecord(&(socketInfo->capture), CAPTURE_CLOSE, client->captureID, 0, &closeCode, sizeof(closeCode));
+
+  free(client->partialFrame);
+  freeArena(&(client->sessionArena));
+  leaveRoute(worker, client);
+  if (client->pathHanlder != NULL)
+    releasePathHandler(client->pathHanlder);
 
   int32_t const clientFD = client->clientFD;
-  epoll_ctl(socketInfo->threads[client->assignedThread].workerEventPoll, EPOLL_CTL_DEL, clientFD, NULL);
-  
+  epoll_ctl(worker->workerEventPoll, EPOLL_CTL_DEL, clientFD, NULL);
+
+  // Cleared before the descriptor is released, the accept loop may get the same number back and fill the slot right away
+  memset(&(socketInfo->connections[clientFD]), 0, sizeof(WSConnection));
   shutdown(clientFD, SHUT_RDWR);
   close(clientFD);
-  
-  memset(&(socketInfo->connections[clientFD]), 0, sizeof(WSConnection));
 }
 
-static void freeConnectionPathForEachWrapper(void * pathPtr, void * pathHandlerPtr, void * contextPtr) {
-  (void)pathHandlerPtr; //unused
-  (void)contextPtr; //unused
+static void hasPooledPathForEachWrapper(void * pathPtr, void * pathHandlerPtr, void * contextPtr) {
+  (void)pathPtr; //unused
 
-  dstrfree(pathPtr);
+  if ((*(WSPathHandler **)pathHandlerPtr)->execMode == WS_EXEC_POOLED)
+    *(uint8_t *)contextPtr = 1;
 }
 
-static uint8_t isHTTPUpgrade(char const * const request, ssize_t length, char * const * path, char * const * key) {
+
+// path is left pointing into request
+static uint8_t isHTTPUpgrade(char const * const request, ssize_t length, DStringView * const path, char * const * key) {
   enum HTTPCHECK {
     GET,
     PATH,
@@ -141,10 +929,9 @@ static uint8_t isHTTPUpgrade(char const * const request, ssize_t length, char *
       case PATH:;
         size_t pathLenght = 0;
         char const * pathStart = ++curr;
-        while (*(curr++) != ' ') pathLenght++;
+        while (curr < request + length && *(curr++) != ' ') pathLenght++;
 
-        memcpy(*path, pathStart, pathLenght);
-        (*path)[pathLenght] = '\0';
+        *path = dstrviewof(pathStart, pathLenght);
 
         state = HTTP;
         break;
@@ -216,7 +1003,6 @@ static uint8_t isHTTPUpgrade(char const * const request, ssize_t length, char *
 }
 
 static void rejectHandshake(WSSocket * const socketInfo, WSConnection * const client, int32_t code) {
-  socklen_t addrLen = sizeof(struct sockaddr_in);
   char rejection[WS_BUFFER_SML];
   char * reason;
   switch (code) {
@@ -226,52 +1012,64 @@ static void rejectHandshake(WSSocket * const socketInfo, WSConnection * const cl
     case 404:
       reason = "Not Found";
       break;
+    case 408:
+      reason = "Request Timeout";
+      break;
     default:
       code = 500;
       reason = "Internal Server Error";
       break;
   }
   sprintf(rejection, "HTTP/1.1 %d %s\r\n\r\n", code, reason);
-  sendto(client->clientFD, rejection, strlen(rejection), 0, &(client->addrInfo), addrLen);
+  endPendingHandshake(socketInfo, client);
+
+  if (client->captureID != 0) {
+    uint16_t const status = code;
+    captureRecord(&(socketInfo->capture), CAPTURE_CLOSE, client->captureID, 0, &status, sizeof(status));
+  }
+  send(client->clientFD, rejection, strlen(rejection), MSG_NOSIGNAL);
 
   int32_t const clientFD = client->clientFD;
   epoll_ctl(socketInfo->threads[client->assignedThread].workerEventPoll, EPOLL_CTL_DEL, clientFD, NULL);
+  memset(&(socketInfo->connections[clientFD]), 0, sizeof(WSConnection));
   shutdown(clientFD, SHUT_RDWR);
   close(clientFD);
-  memset(&(socketInfo->connections[clientFD]), 0, sizeof(WSConnection));
 }
 
 static int8_t performHandshake(WSSocket * const socketInfo, WSConnection * const client) {
-  char addr[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &(client->addrInfo.sin_addr), addr, INET_ADDRSTRLEN);
-  socklen_t addrLen = sizeof(struct sockaddr_in);
+  char addr[WS_ADDRSTRLEN];
+  formatAddress(&(client->addrInfo), client->addrLength, addr);
 
   char recvBuf[WS_BUFFER_BIG];
   ssize_t recvSize;
-  if ((recvSize = recvfrom(client->clientFD, recvBuf, WS_BUFFER_BIG - 1, 0, (struct sockaddr *)&(client->addrInfo), &addrLen)) == -1) {
+  if ((recvSize = recv(client->clientFD, recvBuf, WS_BUFFER_BIG - 1, 0)) == -1) {
     printf("(%s): Could not read message: %s\n", addr, strerror(errno));
     rejectHandshake(socketInfo, client, 500);
     return -1;
   }
   recvBuf[recvSize] = '\0';
 
+  if (socketInfo->isCapturing) {
+    client->captureID = captureConnection(&(socketInfo->capture));
+    captureRecord(&(socketInfo->capture), CAPTURE_HANDSHAKE, client->captureID, 0, recvBuf, recvSize);
+  }
+
   char * key = alloca(WS_BUFFER_SML);
-  char * path = alloca(WS_BUFFER_BIG);
+  DStringView path;
   if (!isHTTPUpgrade(recvBuf, recvSize, &path, &key)) {
     printf("(%s): Invalid websocket upgrade request.\n", addr);
     rejectHandshake(socketInfo, client, 400);
     return -1;
   }
-  DString pathDString;
-  dstrinit(&pathDString, path, strlen(path) + 1);
 
   WSPathHandler * pathHandler;
-  if ((pathHandler = mapGet(&(socketInfo->paths), &pathDString)) == NULL) {
-    printf("(%s): Invalid websocket path (%s).\n", addr, path);
+  if ((pathHandler = findPath(socketInfo, path)) == NULL) {
+    printf("(%s): Invalid websocket path (%.*s).\n", addr, (int)path.length, path.string);
     rejectHandshake(socketInfo, client, 404);
     return -1;
   }
-  dstrfree(&pathDString);
+  // The connection outlives this worker's next quiescent point, and with it the table the handler came from
+  atomic_fetch_add(&(pathHandler->references), 1);
   client->pathHanlder = pathHandler;
 
   char appKey[WS_BUFFER_BIG];
@@ -290,152 +1088,707 @@ static int8_t performHandshake(WSSocket * const socketInfo, WSConnection * const
       "Sec-WebSocket-Accept: %s\r\n\r\n", 
       finalKey);
 
-  sendto(client->clientFD, response, strlen(response), 0, &(client->addrInfo), addrLen);
+  send(client->clientFD, response, strlen(response), MSG_NOSIGNAL);
   client->needsHandshake = 0;
+  endPendingHandshake(socketInfo, client);
+  joinRoute(&(socketInfo->threads[client->assignedThread]), client);
 
-  printf("(%s): Succeful handshake on path %s\n", addr, path);
-
-  client->recvBuffer = malloc(WS_BUFFER_SML * sizeof(char));
-  client->sendBuffer = malloc(WS_BUFFER_SML * sizeof(char));
+  printf("(%s): Succeful handshake on path %.*s\n", addr, (int)path.length, path.string);
   return 0;
 }
 
-static int32_t receiveDataFrom(WSConnection * const client) {
-  char addr[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &(client->addrInfo.sin_addr), addr, INET_ADDRSTRLEN);
-  socklen_t addrLen = sizeof(struct sockaddr_in);
+static void unmaskPayload(uint8_t * const payload, uint64_t const length, uint8_t const mask_4B[4]) {
+  uint64_t mask_8B;
+  for (uint8_t i = 0; i < 8; i++)
+    ((uint8_t *)&mask_8B)[i] = mask_4B[i % 4];
+
+  uint64_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, payload + i, 8);
+    word ^= mask_8B;
+    memcpy(payload + i, &word, 8);
+  }
+  for (; i < length; i++)
+    payload[i] ^= mask_4B[i % 4];
+}
 
-  uint8_t dataHeader_2B[2];
-  recvfrom(client->clientFD, dataHeader_2B, 2, 0, (struct sockaddr *)&(client->addrInfo), &addrLen);
-  uint8_t finBit = dataHeader_2B[0] & 0xF0;
-  uint8_t opcode = dataHeader_2B[0] & 0x0F;
-  uint16_t closeCode = 0;
+static WSHandlerTask * newHandlerTask(WSWorker * const worker, WSConnection * const client, uint8_t const kind) {
+  WSHandlerTask * handlerTask = calloc(1, sizeof(WSHandlerTask));
+  if (handlerTask == NULL)
+    return NULL;
 
-  if (finBit != WS_FIN_BIT_END) {
-    printf("(%s): Refusing to read fragmented data. Closing connection.\n", addr);
-    closeCode = 1003;
-    return closeCode;
-  }
-  if (opcode == WS_OPCODE_CLOSE) {
-    printf("(%s): Client asked to close connection.\n", addr);
-    closeCode = 1000;
-    return closeCode;
-  }
-  if (opcode != WS_OPCODE_TEXT && opcode != WS_OPCODE_PING) {
-    printf("(%s): Refusing to read non-text data. Closing connection.\n", addr);
-    closeCode = 1003;
-    return closeCode;
-  }
+  handlerTask->worker = worker;
+  handlerTask->client = client;
+  handlerTask->kind = kind;
+  return handlerTask;
+}
 
-  uint8_t maskBit = (dataHeader_2B[1] & 0x80) >> 7;
-  if (maskBit != 1) {
-    printf("(%s): Bad message maskBit (protocol violation). Closing connection.\n", addr);
-    closeCode = 1002;
-    return closeCode;
-  }
+static void postCompletion(WSWorker * const worker, WSHandlerTask * const handlerTask) {
+  pthread_mutex_lock(&(worker->completionLock));
+  handlerTask->nextCompletion = worker->completions;
+  worker->completions = handlerTask;
+  pthread_mutex_unlock(&(worker->completionLock));
 
-  uint64_t payloadLen = dataHeader_2B[1] & 0x7F;
-  if (payloadLen == 126) {
-    uint8_t extraLen[2];
-    recvfrom(client->clientFD, extraLen, 2, 0, (struct sockaddr *)&(client->addrInfo), &addrLen);
-    payloadLen = ntohs(*(uint16_t *)extraLen);
-  } else if (payloadLen == 127) {
-    uint8_t extraLen[8];
-    recvfrom(client->clientFD, extraLen, 8, 0, (struct sockaddr *)&(client->addrInfo), &addrLen);
-    payloadLen = ntohl(*(uint64_t *)extraLen);
-  }
+  uint64_t const wake = 1;
+  write(worker->completionFD, &wake, sizeof(wake));
+}
 
-  uint8_t isPing = (opcode == WS_OPCODE_PING) ? 1 : 0;
-  uint8_t mask_4B[4];
-  recvfrom(client->clientFD, mask_4B, 4, 0, (struct sockaddr *)&(client->addrInfo), &addrLen);
+static void openReplySink(WSWorker * const worker, WSConnection * const client, uint8_t const isPooled) {
+  replySink.worker = worker;
+  replySink.client = client;
+  replySink.isPooled = isPooled;
+  replySink.reserved = NULL;
+  replySink.reservedSize = 0;
+}
 
-  if (payloadLen > 0) {
-    char * payloadAlloc = realloc(client->recvBuffer, (payloadLen + 1) * sizeof(char));
-    if (payloadAlloc == NULL) {
-      closeCode = 1001;
-      return closeCode;
-    }
-    client->recvBuffer = payloadAlloc;
-    recvfrom(client->clientFD, client->recvBuffer, payloadLen, 0, (struct sockaddr *)&(client->addrInfo), &addrLen);
-    for (uint64_t i = 0; i < payloadLen; i++)
-      client->recvBuffer[i] ^= mask_4B[i % 4];
-    client->recvBuffer[payloadLen] = '\0';
+static void closeReplySink(void) {
+  // Arena reservations die with the batch, only pooled ones are on the heap
+  if (replySink.isPooled && replySink.reserved != NULL)
+    free(replySink.reserved - WS_FRAME_HEADER_MAX);
+
+  WSConnection * const client = replySink.client;
+  WSStream * finished = replySink.finished;
+  memset(&replySink, 0, sizeof(WSReplySink));
+
+  // Flip them back so onDone runs in the order the streams completed
+  WSStream * ordered = NULL;
+  while (finished != NULL) {
+    WSStream * const next = finished->nextFinished;
+    finished->nextFinished = ordered;
+    ordered = finished;
+    finished = next;
+  }
+  while (ordered != NULL) {
+    WSStream * const next = ordered->nextFinished;
+    finishStream(client, ordered);
+    ordered = next;
   }
+}
 
-  if (isPing) {
-    uint8_t pong[payloadLen + 2];
-    pong[0] = WS_FIN_BIT_END | WS_OPCODE_PONG;
-    pong[1] = dataHeader_2B[1] & (0x7F);
-    if (payloadLen > 0)
-      memcpy(pong + 2, client->recvBuffer, payloadLen);
-    sendto(client->clientFD, pong, payloadLen + 2, 0, (struct sockaddr *)&(client->addrInfo), addrLen);
-    printf("(%s): ping.\n", addr);
-  } else {
-    printf("(%s): \"%s\"\n", addr, client->recvBuffer);
+// Runs on a handler pool thread, anything that has to touch the socket goes back to the owning worker
+static void runHandlerTask(Task * task) {
+  WSHandlerTask * const handlerTask = (WSHandlerTask *)((char *)task - offsetof(WSHandlerTask, task));
+  WSConnection * const client = handlerTask->client;
+
+  switch (handlerTask->kind) {
+    case WS_TASK_HANDSHAKE:
+      openReplySink(handlerTask->worker, client, 1);
+      client->pathHanlder->onHandshake(client);
+      closeReplySink();
+      free(handlerTask);
+      return;
+    case WS_TASK_MESSAGE:;
+      char * outData = NULL;
+      openReplySink(handlerTask->worker, client, 1);
+      size_t size = client->pathHanlder->onMessage(client, handlerTask->data, &outData);
+      closeReplySink();
+      free(handlerTask->data);
+      if (size == 0) {
+        free(outData);
+        free(handlerTask);
+        return;
+      }
+      handlerTask->data = outData;
+      handlerTask->size = size;
+      break;
+    case WS_TASK_BATCH:
+      // Replies went back through commitReply, there is nothing else to complete
+      openReplySink(handlerTask->worker, client, 1);
+      client->pathHanlder->onMessageBatch(client, (WSMessageView const *)handlerTask->data, handlerTask->size);
+      closeReplySink();
+      free(handlerTask->data);
+      free(handlerTask);
+      return;
+    case WS_TASK_DISCONNECT:
+      client->pathHanlder->onDisconnect(client);
+      break;
+    case WS_TASK_PONG:
+      // Nothing to run, it only waits behind the handlers that were queued before the ping
+      break;
   }
 
-  return isPing;
+  postCompletion(handlerTask->worker, handlerTask);
 }
 
-static size_t sendDataTo(WSConnection const * const client, char const * buffer, size_t size) {
-  if (size == 0)
-    return 0;
+static void postHandlerTask(WSConnection * const client, WSHandlerTask * const handlerTask) {
+  handlerTask->task.run = runHandlerTask;
+  handlerTask->task.isFinal = (handlerTask->kind == WS_TASK_DISCONNECT);
+  taskStrandPost(client->strand, &(handlerTask->task));
+}
 
-  socklen_t addrLen = sizeof(struct sockaddr_in);
-  uint8_t headerSize = 2;
-  if (size > 125)
-    headerSize += 2;
-  if (size > 65535)
-    headerSize += 6;
-  
-  uint8_t message[size + headerSize];
-  message[0] = WS_FIN_BIT_END | WS_OPCODE_TEXT;
-  if (headerSize == 2)
-    message[1] = (char)size;
-  else if (headerSize == 4) {
-    message[1] = 126;
-    uint16_t netSize = htons(size);
-    memcpy(message + 2, &netSize, 2 * sizeof(char));
-  }
-  else if (headerSize == 10) {
-    message[1] = 127;
-    uint64_t netSize = htonl(size);
-    memcpy(message + 2, &netSize, 8 * sizeof(char));
-  }
-
-  memcpy(message + headerSize, buffer, size);
-  sendto(client->clientFD, message, size + headerSize, 0, &(client->addrInfo), addrLen);
-  return size;
+static void closePooledConnection(WSWorker * const worker, WSConnection * const client, uint16_t const closeCode) {
+  // Stop reading right away, the socket itself stays open until onDisconnect has run on the pool
+  client->isClosing = 1;
+  epoll_ctl(worker->workerEventPoll, EPOLL_CTL_DEL, client->clientFD, NULL);
+  leaveRoute(worker, client);
+
+  WSHandlerTask * const handlerTask = client->disconnectTask;
+  client->disconnectTask = NULL;
+  handlerTask->closeCode = closeCode;
+  postHandlerTask(client, handlerTask);
 }
 
-static void * threadLoop(void * args) {
-   WSWorker * this = args;
-   struct epoll_event eventsTriggered[WS_EVENTS_PER_LOOP];
-   for (;;) {
-     int32_t events = epoll_wait(this->workerEventPoll, eventsTriggered, WS_EVENTS_PER_LOOP, -1);
-     for (int32_t i = 0; i < events; i++) {
+// Queues one broadcast for every connection this worker owns on its path, all frames share the task's payload
+static void deliverBroadcast(WSWorker * const worker, WSHandlerTask * const handlerTask) {
+  WSRouteMembers const * const members = findRouteMembers(worker, handlerTask->routeID);
+  if (members == NULL)
+    return;
+
+  for (int32_t fd = members->first; fd != -1;) {
+    WSConnection * const client = &(worker->socket->connections[fd]);
+    fd = client->nextRouteMember;
+    queueFrame(worker, client, WS_OPCODE_TEXT, handlerTask->data, handlerTask->size, WS_PAYLOAD_BATCH);
+  }
+}
+
+static void drainCompletions(WSWorker * const worker) {
+  uint64_t wakes;
+  read(worker->completionFD, &wakes, sizeof(wakes));
+
+  pthread_mutex_lock(&(worker->completionLock));
+  WSHandlerTask * pushed = worker->completions;
+  worker->completions = NULL;
+  pthread_mutex_unlock(&(worker->completionLock));
+
+  // Completions are pushed newest first, flip them so each connection sees its replies in order
+  WSHandlerTask * ordered = NULL;
+  while (pushed != NULL) {
+    WSHandlerTask * next = pushed->nextCompletion;
+    pushed->nextCompletion = ordered;
+    ordered = pushed;
+    pushed = next;
+  }
+
+  while (ordered != NULL) {
+    WSHandlerTask * const handlerTask = ordered;
+    WSConnection * const client = handlerTask->client;
+    ordered = handlerTask->nextCompletion;
+
+    if ((handlerTask->kind == WS_TASK_MESSAGE || handlerTask->kind == WS_TASK_REPLY) && worker->traceSpan.isActive
+        && worker->traceSpan.connection == client->clientFD && worker->traceSpan.stamps[TRACE_HANDLER] != 0 && worker->traceSpan.stamps[TRACE_SEND] == 0)
+      worker->traceSpan.stamps[TRACE_SEND] = traceNow();
+
+    if (handlerTask->kind == WS_TASK_MESSAGE) {
+      sendDataTo(worker, client, handlerTask->data, handlerTask->size);
+    } else if (handlerTask->kind == WS_TASK_REPLY) {
+      char * const payload = handlerTask->data + WS_FRAME_HEADER_MAX;
+      char * const frame = encodeInPlace(payload, WS_OPCODE_TEXT, handlerTask->size);
+      queueEncodedFrame(worker, client, frame, payload + handlerTask->size - frame, WS_PAYLOAD_OWNED, handlerTask->data);
+    } else if (handlerTask->kind == WS_TASK_PONG) {
+      queueFrame(worker, client, WS_OPCODE_PONG, handlerTask->data, handlerTask->size, WS_PAYLOAD_OWNED);
+    } else if (handlerTask->kind == WS_TASK_STREAM) {
+      if (queueStream(worker, client, (WSStream *)handlerTask->data) == -1)
+        finishStream(client, (WSStream *)handlerTask->data);
+    } else if (handlerTask->kind == WS_TASK_DISCONNECT) {
+      freeTaskStrand(client->strand);
+      free(client->strand);
+      freeConnectionResources(worker->socket, client, handlerTask->closeCode);
+    } else if (handlerTask->kind == WS_TASK_BROADCAST) {
+      deliverBroadcast(worker, handlerTask);
+      handlerTask->nextCompletion = worker->retiredBroadcasts;
+      worker->retiredBroadcasts = handlerTask;
+      continue;
+    }
+    free(handlerTask);
+  }
+}
+
+static void dispatchHandshake(WSWorker * const worker, WSConnection * const client) {
+  if (client->pathHanlder->execMode == WS_EXEC_POOLED) {
+    client->strand = malloc(sizeof(TaskStrand));
+    client->disconnectTask = newHandlerTask(worker, client, WS_TASK_DISCONNECT);
+    WSHandlerTask * handlerTask = newHandlerTask(worker, client, WS_TASK_HANDSHAKE);
+    if (client->strand != NULL && client->disconnectTask != NULL && handlerTask != NULL
+        && initTaskStrand(client->strand, &(worker->socket->handlerPool)) == 0) {
+      postHandlerTask(client, handlerTask);
+      return;
+    }
+    free(handlerTask);
+    free(client->disconnectTask);
+    free(client->strand);
+    client->disconnectTask = NULL;
+    client->strand = NULL;
+    // Without a strand the connection can only be served inline
+    printf("(Server): Could not allocate handler strand, serving connection inline.\n");
+  }
+
+  openReplySink(worker, client, 0);
+  client->pathHanlder->onHandshake(client);
+  closeReplySink();
+}
+
+// payload is NUL terminated and only valid for the duration of the call
+static void dispatchMessage(WSWorker * const worker, WSConnection * const client, char const * const payload, size_t const length) {
+  if (client->strand != NULL) {
+    WSHandlerTask * handlerTask = newHandlerTask(worker, client, WS_TASK_MESSAGE);
+    if (handlerTask != NULL && (handlerTask->data = malloc(length + 1)) != NULL) {
+      memcpy(handlerTask->data, payload, length + 1);
+      postHandlerTask(client, handlerTask);
+      return;
+    }
+    free(handlerTask);
+    printf("(Server): Could not allocate handler task, dropping message.\n");
+    return;
+  }
+
+  char * outData = NULL;
+  openReplySink(worker, client, 0);
+  size_t size = client->pathHanlder->onMessage(client, payload, &outData);
+  closeReplySink();
+  // The queue owns the reply until it is written
+  sendDataTo(worker, client, outData, size);
+}
+
+// Hands everything batched from the current read to onMessageBatch, before the read buffer is reused
+static void deliverBatch(WSWorker * const worker, WSConnection * const client) {
+  uint32_t const count = worker->batchCount;
+  if (count == 0)
+    return;
+  worker->batchCount = 0;
+
+  TraceSpan * const span = &(worker->traceSpan);
+  uint8_t const isTraced = span->isActive && span->connection == client->clientFD && span->stamps[TRACE_HANDLER] == 0;
+  if (isTraced)
+    span->stamps[TRACE_HANDLER] = traceNow();
+
+  if (client->strand != NULL) {
+    // One allocation for the views and a copy of every payload behind them
+    size_t size = count * sizeof(WSMessageView);
+    for (uint32_t i = 0; i < count; i++)
+      size += worker->batch[i].length + 1;
+
+    WSHandlerTask * handlerTask = newHandlerTask(worker, client, WS_TASK_BATCH);
+    if (handlerTask != NULL && (handlerTask->data = malloc(size)) != NULL) {
+      WSMessageView * const views = (WSMessageView *)handlerTask->data;
+      char * copy = handlerTask->data + count * sizeof(WSMessageView);
+      for (uint32_t i = 0; i < count; i++) {
+        memcpy(copy, worker->batch[i].data, worker->batch[i].length);
+        copy[worker->batch[i].length] = '\0';
+        views[i].data = copy;
+        views[i].length = worker->batch[i].length;
+        copy += worker->batch[i].length + 1;
+      }
+      handlerTask->size = count;
+      postHandlerTask(client, handlerTask);
+      return;
+    }
+    free(handlerTask);
+    printf("(Server): Could not allocate handler task, dropping %u messages.\n", count);
+    return;
+  }
+
+  openReplySink(worker, client, 0);
+  client->pathHanlder->onMessageBatch(client, worker->batch, count);
+  closeReplySink();
+  if (isTraced)
+    span->stamps[TRACE_SEND] = traceNow();
+}
+
+static void dispatchDisconnect(WSWorker * const worker, WSConnection * const client, uint16_t const closeCode) {
+  if (client->strand != NULL) {
+    closePooledConnection(worker, client, closeCode);
+    return;
+  }
+
+  client->pathHanlder->onDisconnect(client);
+  freeConnectionResources(worker->socket, client, closeCode);
+}
+
+typedef struct {
+  uint8_t finBit;
+  uint8_t opcode;
+  uint8_t maskBit;
+  uint8_t headerLength; // Mask included
+  uint64_t payloadLength;
+} WSFrameHeader;
+
+// Returns 1 once the whole header is in data, 0 while more bytes are needed
+static uint8_t readFrameHeader(uint8_t const * const data, size_t const length, WSFrameHeader * const header) {
+  if (length < 2)
+    return 0;
+
+  header->finBit = data[0] & 0xF0;
+  header->opcode = data[0] & 0x0F;
+  header->maskBit = (data[1] & 0x80) >> 7;
+  header->payloadLength = data[1] & 0x7F;
+  header->headerLength = 2;
+
+  if (header->payloadLength == 126) {
+    if (length < 4)
+      return 0;
+    header->payloadLength = ((uint16_t)data[2] << 8) | data[3];
+    header->headerLength = 4;
+  } else if (header->payloadLength == 127) {
+    if (length < 10)
+      return 0;
+    header->payloadLength = 0;
+    for (uint8_t i = 0; i < 8; i++)
+      header->payloadLength = (header->payloadLength << 8) | data[2 + i];
+    header->headerLength = 10;
+  }
+
+  if (header->maskBit)
+    header->headerLength += 4;
+  return length >= header->headerLength;
+}
+
+// Everything that can be refused before the payload arrives. Returns the close code, 0 if the frame is acceptable
+static uint16_t checkFrameHeader(WSSocket const * const socketInfo, WSFrameHeader const * const header, char const * const addr) {
+  if (header->finBit != WS_FIN_BIT_END) {
+    printf("(%s): Refusing to read fragmented data. Closing connection.\n", addr);
+    return 1003;
+  }
+  if (header->opcode == WS_OPCODE_CLOSE) {
+    printf("(%s): Client asked to close connection.\n", addr);
+    return 1000;
+  }
+  if (header->opcode != WS_OPCODE_TEXT && header->opcode != WS_OPCODE_PING) {
+    printf("(%s): Refusing to read non-text data. Closing connection.\n", addr);
+    return 1003;
+  }
+  if (header->maskBit != 1) {
+    printf("(%s): Bad message maskBit (protocol violation). Closing connection.\n", addr);
+    return 1002;
+  }
+  if (header->payloadLength > socketInfo->memory.maxMessageSize) {
+    printf("(%s): Message of %llu bytes is too big. Closing connection.\n", addr, (unsigned long long)header->payloadLength);
+    return 1009;
+  }
+  return 0;
+}
+
+// frame must have one writable byte past its end for the payload terminator. Returns the close code, 0 to keep going
+static uint16_t handleFrame(WSWorker * const worker, WSConnection * const client, WSFrameHeader const * const header, uint8_t * const frame, char const * const addr) {
+  uint8_t * const payload = frame + header->headerLength;
+  size_t const length = header->payloadLength;
+  unmaskPayload(payload, length, payload - 4);
+
+  // The byte after the payload may be the start of the next frame
+  uint8_t const following = payload[length];
+  payload[length] = '\0';
+
+  if (client->captureID != 0)
+    captureRecord(&(worker->socket->capture), CAPTURE_FRAME, client->captureID, header->opcode, payload, length);
+
+  uint16_t closeCode = 0;
+  if (header->opcode == WS_OPCODE_TEXT && !utf8Validate(payload, length)) {
+    printf("(%s): Text message is not valid UTF-8. Closing connection.\n", addr);
+    closeCode = 1007;
+  } else if (header->opcode == WS_OPCODE_PING) {
+    // Replies to earlier messages go out first
+    deliverBatch(worker, client);
+    if (client->strand != NULL) {
+      // Pooled replies come back through the strand, so the pong has to queue behind them there
+      WSHandlerTask * const handlerTask = newHandlerTask(worker, client, WS_TASK_PONG);
+      char * const data = malloc(length + 1);
+      if (handlerTask == NULL || data == NULL) {
+        free(handlerTask);
+        free(data);
+        printf("(%s): Could not allocate pong, dropping it.\n", addr);
+      } else {
+        memcpy(data, payload, length);
+        handlerTask->data = data;
+        handlerTask->size = length;
+        postHandlerTask(client, handlerTask);
+      }
+    } else {
+      char * pong = arenaAlloc(&(worker->replyArena), WS_FRAME_HEADER_MAX + length);
+      if (pong != NULL) {
+        memcpy(pong + WS_FRAME_HEADER_MAX, payload, length);
+        char * const pongFrame = encodeInPlace(pong + WS_FRAME_HEADER_MAX, WS_OPCODE_PONG, length);
+        queueEncodedFrame(worker, client, pongFrame, (pong + WS_FRAME_HEADER_MAX + length) - pongFrame, WS_PAYLOAD_BATCH, NULL);
+      }
+    }
+    printf("(%s): ping.\n", addr);
+  } else if (client->pathHanlder->onMessageBatch != NULL) {
+    printf("(%s): \"%s\"\n", addr, (char *)payload);
+    worker->batch[worker->batchCount].data = (char const *)payload;
+    worker->batch[worker->batchCount].length = length;
+    if (++(worker->batchCount) == WS_MESSAGE_BATCH_MAX)
+      deliverBatch(worker, client);
+  } else {
+    printf("(%s): \"%s\"\n", addr, (char *)payload);
+    TraceSpan * const span = &(worker->traceSpan);
+    uint8_t const isTraced = span->isActive && span->connection == client->clientFD && span->stamps[TRACE_HANDLER] == 0;
+    if (isTraced)
+      span->stamps[TRACE_HANDLER] = traceNow();
+    dispatchMessage(worker, client, (char *)payload, length);
+    // Pooled handlers are stamped when their result comes back
+    if (isTraced && client->strand == NULL)
+      span->stamps[TRACE_SEND] = traceNow();
+  }
+
+  payload[length] = following;
+  return closeCode;
+}
+
+static void releasePartialFrame(WSSocket const * const socketInfo, WSConnection * const client) {
+  client->partialLength = 0;
+  client->partialNeeded = 0;
+  if (client->partialCapacity > socketInfo->memory.keepPartialBytes) {
+    free(client->partialFrame);
+    client->partialFrame = NULL;
+    client->partialCapacity = 0;
+  }
+}
+
+// Holds on to the start of a frame until the rest of it arrives. Returns 0 on success, -1 otherwise
+static int8_t keepPartialFrame(WSConnection * const client, uint8_t const * const data, size_t const length, size_t const needed) {
+  size_t const capacity = (needed == 0) ? WS_FRAME_PREFIX_MAX : needed + 1;
+  if (client->partialCapacity < capacity) {
+    uint8_t * const grown = realloc(client->partialFrame, capacity);
+    if (grown == NULL)
+      return -1;
+    client->partialFrame = grown;
+    client->partialCapacity = capacity;
+  }
+
+  memmove(client->partialFrame, data, length);
+  client->partialLength = length;
+  client->partialNeeded = needed;
+  return 0;
+}
+
+// Plain recv unless the read is sampled for tracing, then the kernel receive timestamp comes along with the data
+static ssize_t readSocket(WSWorker * const worker, WSConnection * const client, void * const buffer, size_t const length, uint8_t const isSampled) {
+  if (!isSampled)
+    return recv(client->clientFD, buffer, length, 0);
+
+  uint64_t const readAt = traceNow();
+  struct iovec iov = {
+    .iov_base = buffer,
+    .iov_len = length
+  };
+  union {
+    char buffer[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buffer,
+    .msg_controllen = sizeof(control.buffer)
+  };
+  ssize_t const received = recvmsg(client->clientFD, &message, 0);
+  if (received <= 0)
+    return received;
+
+  TraceSpan * const span = &(worker->traceSpan);
+  memset(span, 0, sizeof(TraceSpan));
+  for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+      continue;
+    struct scm_timestamping timestamps;
+    memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+    span->stamps[TRACE_QUEUE] = (uint64_t)timestamps.ts[0].tv_sec * 1000000000 + timestamps.ts[0].tv_nsec;
+  }
+  span->stamps[TRACE_WAKEUP] = worker->wokeAt;
+  span->stamps[TRACE_DECODE] = readAt;
+  span->connection = client->clientFD;
+  span->isActive = 1;
+  return received;
+}
+
+// Reads until the socket runs dry, handling every complete frame on the way. Returns the close code, 0 to keep the connection
+static uint16_t receiveDataFrom(WSWorker * const worker, WSConnection * const client) {
+  WSSocket const * const socketInfo = worker->socket;
+  size_t const readBufferSize = socketInfo->memory.readBufferSize;
+  char addr[WS_ADDRSTRLEN];
+  formatAddress(&(client->addrInfo), client->addrLength, addr);
+
+  // Counting events rather than reads, every event ends in a read that would block
+  uint8_t isSampled = 0;
+  if (socketInfo->traceSampleEvery != 0 && !worker->traceSpan.isActive && --(worker->traceCountdown) == 0) {
+    worker->traceCountdown = socketInfo->traceSampleEvery;
+    isSampled = 1;
+  }
+
+  for (;;) {
+    // Frames too big for the read buffer are read straight into their own buffer
+    if (client->partialNeeded > readBufferSize) {
+      ssize_t const received = readSocket(worker, client, client->partialFrame + client->partialLength, client->partialNeeded - client->partialLength, isSampled);
+      isSampled = 0;
+      if (received == 0 || (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        printf("(%s): Connection lost.\n", addr);
+        return 1001;
+      }
+      if (received == -1)
+        return 0;
+
+      client->partialLength += received;
+      if (client->partialLength < client->partialNeeded)
+        continue;
+
+      WSFrameHeader header;
+      readFrameHeader(client->partialFrame, client->partialLength, &header);
+      uint16_t const closeCode = handleFrame(worker, client, &header, client->partialFrame, addr);
+      deliverBatch(worker, client);
+      releasePartialFrame(socketInfo, client);
+      if (closeCode != 0)
+        return closeCode;
+      continue;
+    }
+
+    // Leave room for a pending frame start in front, it is only moved once there is something to add to it
+    size_t const carried = client->partialLength;
+    ssize_t const received = readSocket(worker, client, worker->readBuffer + carried, readBufferSize - carried, isSampled);
+    isSampled = 0;
+    if (received == 0 || (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      printf("(%s): Connection lost.\n", addr);
+      return 1001;
+    }
+    if (received == -1)
+      return 0;
+
+    if (carried > 0) {
+      memcpy(worker->readBuffer, client->partialFrame, carried);
+      releasePartialFrame(socketInfo, client);
+    }
+
+    size_t const available = carried + received;
+    size_t offset = 0;
+    size_t needed = 0;
+    uint16_t closeCode = 0;
+    while (offset < available) {
+      WSFrameHeader header;
+      if (!readFrameHeader(worker->readBuffer + offset, available - offset, &header))
+        break;
+
+      if ((closeCode = checkFrameHeader(socketInfo, &header, addr)) != 0)
+        break;
+
+      size_t const frameSize = header.headerLength + header.payloadLength;
+      if (available - offset < frameSize) {
+        needed = frameSize;
+        break;
+      }
+      if ((closeCode = handleFrame(worker, client, &header, worker->readBuffer + offset, addr)) != 0)
+        break;
+      offset += frameSize;
+    }
+
+    // Messages that came before a close still get their turn
+    deliverBatch(worker, client);
+    if (closeCode != 0)
+      return closeCode;
+
+    if (offset < available && keepPartialFrame(client, worker->readBuffer + offset, available - offset, needed) == -1) {
+      printf("(%s): Could not hold a partial message. Closing connection.\n", addr);
+      return 1011;
+    }
+  }
+}
+
+// How long the worker may sleep before the earliest handshake deadline, -1 when there is none
+static int32_t handshakeWaitMillis(WSWorker const * const worker) {
+  if (worker->firstHandshake == -1)
+    return -1;
+
+  uint64_t const deadline = worker->socket->connections[worker->firstHandshake].handshakeDeadline;
+  uint64_t const now = monotonicMicros();
+  return (deadline <= now) ? 0 : (int32_t)((deadline - now + 999) / 1000);
+}
+
+// A connection that never sends its upgrade request would hold a maxPendingHandshakes slot forever
+static void expireHandshakes(WSWorker * const worker) {
+  if (worker->firstHandshake == -1)
+    return;
+
+  uint64_t const now = monotonicMicros();
+  while (worker->firstHandshake != -1) {
+    WSConnection * const client = &(worker->socket->connections[worker->firstHandshake]);
+    if (client->handshakeDeadline > now)
+      return;
+
+    char addr[WS_ADDRSTRLEN];
+    formatAddress(&(client->addrInfo), client->addrLength, addr);
+    printf("(%s): No upgrade request in time. Closing connection.\n", addr);
+    rejectHandshake(worker->socket, client, 408);
+  }
+}
+
+// Spins on a non-blocking epoll_wait for the busy poll budget before sleeping in a blocking one
+static int32_t waitForEvents(WSWorker * const worker, struct epoll_event * const events) {
+  uint64_t const start = monotonicNanos();
+  uint64_t const spinNanos = (uint64_t)worker->socket->busyPoll.spinMicros * 1000;
+
+  if (spinNanos != 0) {
+    uint64_t now = start;
+    do {
+      int32_t const ready = epoll_wait(worker->workerEventPoll, events, WS_EVENTS_PER_LOOP, 0);
+      if (ready != 0) {
+        worker->stats.spinNanos += monotonicNanos() - start;
+        worker->stats.spinWakeups++;
+        return ready;
+      }
+      now = monotonicNanos();
+    } while (now - start < spinNanos);
+    worker->stats.spinNanos += now - start;
+  }
+
+  uint64_t const blockedAt = monotonicNanos();
+  int32_t const ready = epoll_wait(worker->workerEventPoll, events, WS_EVENTS_PER_LOOP, handshakeWaitMillis(worker));
+  worker->stats.blockNanos += monotonicNanos() - blockedAt;
+  worker->stats.blockWakeups++;
+  return ready;
+}
+
+static void * threadLoop(void * args) {
+   WSWorker * this = args;
+   struct epoll_event eventsTriggered[WS_EVENTS_PER_LOOP];
+   uint32_t const reader = this - this->socket->threads;
+   // closeSocket cancels workers, only while they wait so no connection is left half torn down
+   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+   for (;;) {
+     // Nothing is held across iterations, the route table can move on while the worker waits
+     epochOffline(&(this->socket->routeEpochs), reader);
+     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+     int32_t events = waitForEvents(this, eventsTriggered);
+     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+     epochQuiescent(&(this->socket->routeEpochs), reader);
+     uint64_t const busyFrom = monotonicNanos();
+     if (this->socket->traceSampleEvery != 0)
+       this->wokeAt = traceNow();
+     for (int32_t i = 0; i < events; i++) {
+       if (eventsTriggered[i].data.fd == this->completionFD) {
+         drainCompletions(this);
+         continue;
+       }
+
        WSConnection * const connection = &(this->socket->connections[eventsTriggered[i].data.fd]);
-       if (memcmp(connection, &nullConn, sizeof(WSConnection)) == 0) {
+       if (memcmp(connection, &nullConn, sizeof(WSConnection)) == 0 || connection->isClosing) {
          printf("Connection already closed.\n");
          continue;
        }
+       if (connection->needsHandshake && connection->handshakeDeadline == 0) {
+         startHandshakeDeadline(this, connection);
+         if (!(eventsTriggered[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+           continue;
+       }
+       if (eventsTriggered[i].events & EPOLLOUT) {
+         flushConnection(this, connection);
+         if (!(eventsTriggered[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+           continue;
+       }
        if (connection->needsHandshake) {
          if (performHandshake(this->socket, connection) == -1)
            continue;
-         connection->pathHanlder->onHandshake(connection);
+         dispatchHandshake(this, connection);
        } else {
-         int32_t closeCode;
-         if ((closeCode = receiveDataFrom(connection)) > 1) {
-           connection->pathHanlder->onDisconnect(connection);
-           freeConnectionResources(this->socket, connection, closeCode);
-           continue;
-         } else if (closeCode == 1) {
+         uint16_t closeCode;
+         if ((closeCode = receiveDataFrom(this, connection)) != 0) {
+           dispatchDisconnect(this, connection, closeCode);
            continue;
          }
-         size_t size = connection->pathHanlder->onMessage(connection, connection->recvBuffer, &(connection->sendBuffer));
-         sendDataTo(connection, connection->sendBuffer, size);
        }
+
+       if (this->firstQueuedAt != 0 && monotonicMicros() - this->firstQueuedAt >= this->socket->coalesceMaxDelayUs)
+         flushWorker(this);
      }
+     expireHandshakes(this);
+     flushWorker(this);
+     this->stats.busyNanos += monotonicNanos() - busyFrom;
    }
 
    return NULL;
@@ -444,81 +1797,260 @@ static void * threadLoop(void * args) {
 int8_t initSocket(WSSocket * socketInfo) {
   memset(socketInfo, 0, sizeof(WSSocket));
 
-  if ((socketInfo->socketFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
-    printf("Could not start a new socket: %s\n", strerror(errno));
+  if ((socketInfo->socketEventPoll = epoll_create1(0)) == -1) {
+    printf("Could not create event poll for new socket: %s\n", strerror(errno));
     return -1;
   }
 
-  if ((socketInfo->socketEventPoll = epoll_create1(0)) == -1) {
-    printf("Could not create event poll for new socket: %s\n", strerror(errno));
-    goto closeSocket;
+  socketInfo->connections = calloc(WS_MAX_CONNECTIONS, sizeof(WSConnection));
+  socketInfo->coalesceMaxBytes = WS_COALESCE_MAX_BYTES;
+  socketInfo->coalesceMaxDelayUs = WS_COALESCE_MAX_DELAY_US;
+  socketInfo->streamChunkSize = WS_STREAM_CHUNK_SIZE;
+  socketInfo->admission.backlog = WS_SOCKET_BACKLOG;
+  socketInfo->admission.acceptBudget = WS_ACCEPT_BUDGET;
+  socketInfo->admission.handshakeTimeoutMs = WS_HANDSHAKE_TIMEOUT_MS;
+  socketInfo->memory.readBufferSize = WS_READ_BUFFER_SIZE;
+  socketInfo->memory.keepOutFrames = WS_KEEP_OUT_FRAMES;
+  socketInfo->memory.maxMessageSize = WS_MAX_MESSAGE_SIZE;
+  if ((socketInfo->routes = newRouteTable()) == NULL) {
+    printf("Could not allocate route table\n");
+    return -1;
+  }
+  pthread_mutex_init(&(socketInfo->routeLock), NULL);
+  if (initEpochDomain(&(socketInfo->routeEpochs), WS_MAX_THREADS + 1) == -1) {
+    printf("Could not create route epochs\n");
+    return -1;
   }
 
-  if (setsockopt(socketInfo->socketFD, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &(socketInfo->socketOpts), sizeof(socketInfo->socketOpts)) == -1) {
-    printf("Could not set socket options for new socket: %s\n", strerror(errno));
-    goto closeSocket;
+  return 0;
+}
+
+// v6Only is -1 to leave IPV6_V6ONLY alone (non IPv6 listeners), otherwise its value. Returns the listening descriptor, -1 on failure
+static int32_t openListener(WSSocket const * socketInfo, struct sockaddr_storage const * const addrInfo, socklen_t const addrLength, int32_t const v6Only) {
+  char addr[WS_ADDRSTRLEN];
+  formatAddress(addrInfo, addrLength, addr);
+
+  int32_t listenerFD;
+  if ((listenerFD = socket(addrInfo->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+    printf("Could not start a new socket for %s: %s\n", addr, strerror(errno));
+    return -1;
   }
 
-  socketInfo->connections = calloc(WS_MAX_CONNECTIONS, sizeof(WSConnection));
-  initMap(&(socketInfo->paths), sizeof(DString), sizeof(WSPathHandler), comparePaths, hashString);
+  int32_t const enable = 1;
+  if (addrInfo->ss_family != AF_UNIX && setsockopt(listenerFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) {
+    printf("Could not set socket options for %s: %s\n", addr, strerror(errno));
+    goto closeListener;
+  }
 
-  struct epoll_event socketEvent = {
-    .data.fd = socketInfo->socketFD,
-    .events = EPOLLIN
-  };
-  if (epoll_ctl(socketInfo->socketEventPoll, EPOLL_CTL_ADD, socketInfo->socketFD, &socketEvent) == -1) {
-    printf("Could not track event for new socket: %s\n", strerror(errno));
-    goto closeSocket;
+  // Every cluster process gets its own accept queue and the kernel spreads connections between them
+  if (socketInfo->clusterProcesses > 1 && addrInfo->ss_family != AF_UNIX
+      && setsockopt(listenerFD, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+    printf("Could not share %s between cluster processes: %s\n", addr, strerror(errno));
+    goto closeListener;
   }
 
-  return 0;
+  if (v6Only != -1 && setsockopt(listenerFD, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only)) == -1) {
+    printf("Could not set IPv6 options for %s: %s\n", addr, strerror(errno));
+    goto closeListener;
+  }
+
+  if (bind(listenerFD, (struct sockaddr const *)addrInfo, addrLength) == -1) {
+    printf("Could not bind socket to %s: %s\n", addr, strerror(errno));
+    goto closeListener;
+  }
+
+  if (listen(listenerFD, socketInfo->admission.backlog) == -1) {
+    printf("Could not start listening on %s: %s\n", addr, strerror(errno));
+    goto closeListener;
+  }
 
-  closeSocket:
-    closeSocket(socketInfo);
+  return listenerFD;
+
+  closeListener:
+    close(listenerFD);
     return -1;
 }
 
-int8_t bindSocket(WSSocket * socketInfo, uint32_t const port) {
-  socklen_t addrLen = sizeof(struct sockaddr_in);
+static int8_t addListener(WSSocket * socketInfo, struct sockaddr_storage const * const addrInfo, socklen_t const addrLength, int32_t const v6Only) {
+  if (socketInfo->listenerCount == WS_MAX_LISTENERS) {
+    char addr[WS_ADDRSTRLEN];
+    formatAddress(addrInfo, addrLength, addr);
+    printf("Could not listen on %s: too many listeners\n", addr);
+    return -1;
+  }
+
+  int32_t const listenerFD = openListener(socketInfo, addrInfo, addrLength, v6Only);
+  if (listenerFD == -1)
+    return -1;
 
-  memset(&(socketInfo->addrInfo), 0, addrLen);
-  socketInfo->addrInfo.sin_family = AF_INET;
-  socketInfo->addrInfo.sin_port = htons(port);
-  socketInfo->addrInfo.sin_addr.s_addr = INADDR_ANY;
+  WSListener * const listener = &(socketInfo->listeners[socketInfo->listenerCount++]);
+  listener->listenerFD = listenerFD;
+  memcpy(&(listener->addrInfo), addrInfo, addrLength);
+  listener->addrLength = addrLength;
+  listener->v6Only = v6Only;
+  return 0;
+}
 
-  if (bind(socketInfo->socketFD, (struct sockaddr *)&(socketInfo->addrInfo), addrLen) == -1) {
-    printf("Could not bind socket to port %d: %s\n", port, strerror(errno));
-    goto closeSocket;
+int8_t bindSocket(WSSocket * socketInfo, uint32_t const port) {
+  struct sockaddr_storage addrInfo = {0};
+  struct sockaddr_in6 * const addr6 = (struct sockaddr_in6 *)&addrInfo;
+  addr6->sin6_family = AF_INET6;
+  addr6->sin6_port = htons(port);
+  addr6->sin6_addr = in6addr_any;
+
+  int32_t const probeFD = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probeFD != -1) {
+    close(probeFD);
+    return addListener(socketInfo, &addrInfo, sizeof(struct sockaddr_in6), 0);
   }
 
-  if (listen(socketInfo->socketFD, WS_SOCKET_BACKLOG) == -1) {
-    printf("Could not start listening on port %d: %s\n", port, strerror(errno));
-    goto closeSocket;
+  // No IPv6 on this system, plain IPv4 it is
+  memset(&addrInfo, 0, sizeof(addrInfo));
+  struct sockaddr_in * const addr4 = (struct sockaddr_in *)&addrInfo;
+  addr4->sin_family = AF_INET;
+  addr4->sin_port = htons(port);
+  addr4->sin_addr.s_addr = INADDR_ANY;
+  return addListener(socketInfo, &addrInfo, sizeof(struct sockaddr_in), -1);
+}
+
+int8_t bindSocketAddress(WSSocket * socketInfo, char const * const address, uint32_t const port) {
+  struct sockaddr_storage addrInfo = {0};
+  struct sockaddr_in * const addr4 = (struct sockaddr_in *)&addrInfo;
+  struct sockaddr_in6 * const addr6 = (struct sockaddr_in6 *)&addrInfo;
+
+  if (inet_pton(AF_INET, address, &(addr4->sin_addr)) == 1) {
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(port);
+    return addListener(socketInfo, &addrInfo, sizeof(struct sockaddr_in), -1);
+  }
+  if (inet_pton(AF_INET6, address, &(addr6->sin6_addr)) == 1) {
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(port);
+    // Only what was asked for, so an IPv4 listener on the same port can sit next to it
+    return addListener(socketInfo, &addrInfo, sizeof(struct sockaddr_in6), 1);
   }
 
-  return 0;
+  printf("Could not parse listening address \"%s\"\n", address);
+  return -1;
+}
 
-  closeSocket:
-    closeSocket(socketInfo);
+int8_t bindSocketUnix(WSSocket * socketInfo, char const * const path) {
+  struct sockaddr_storage addrInfo = {0};
+  struct sockaddr_un * const addrUnix = (struct sockaddr_un *)&addrInfo;
+  addrUnix->sun_family = AF_UNIX;
+
+  size_t const pathLength = strlen(path);
+  if (pathLength == 0 || pathLength >= sizeof(addrUnix->sun_path)) {
+    printf("Could not listen on \"%s\": bad socket path length\n", path);
     return -1;
+  }
+  memcpy(addrUnix->sun_path, path, pathLength);
+
+  if (path[0] == '@') {
+    // Abstract names are not NUL terminated, the address length says where they end
+    addrUnix->sun_path[0] = '\0';
+    return addListener(socketInfo, &addrInfo, offsetof(struct sockaddr_un, sun_path) + pathLength, -1);
+  }
+
+  // A socket file left over from a previous run would make bind fail, anything else is not ours to remove
+  struct stat pathStat;
+  if (lstat(path, &pathStat) == 0 && S_ISSOCK(pathStat.st_mode))
+    unlink(path);
+
+  return addListener(socketInfo, &addrInfo, sizeof(struct sockaddr_un), -1);
 }
 
 void closeSocket(WSSocket * socketInfo) {
-  for (int32_t i = 0; i < WS_MAX_CONNECTIONS; i++)
-    if (memcmp(&(socketInfo->connections[i]), &nullConn, sizeof(WSConnection)) == 0)
-      freeConnectionResources(socketInfo, &(socketInfo->connections[i]), 1001);
+  for (uint8_t i = 1; i < BUS_MAX_PROCESSES; i++) {
+    if (socketInfo->clusterPIDs[i] > 0) {
+      kill(socketInfo->clusterPIDs[i], SIGTERM);
+      waitpid(socketInfo->clusterPIDs[i], NULL, 0);
+    }
+  }
 
-  free(socketInfo->connections);
+  for (uint8_t i = 0; i < WS_MAX_THREADS; i++) {
+    if (socketInfo->threads[i].thread != 0) {
+      pthread_cancel(socketInfo->threads[i].thread);
+      pthread_join(socketInfo->threads[i].thread, NULL);
+    }
+  }
+
+  if (socketInfo->hasHandlerPool) {
+    // Pooled connections still get onDisconnect, after whatever their strand already has queued
+    for (int32_t i = 0; socketInfo->connections != NULL && i < WS_MAX_CONNECTIONS; i++) {
+      WSConnection * const connection = &(socketInfo->connections[i]);
+      if (connection->strand != NULL && !connection->isClosing)
+        closePooledConnection(&(socketInfo->threads[connection->assignedThread]), connection, 1001);
+    }
+    stopTaskPool(&(socketInfo->handlerPool));
+  }
 
+  // The workers are gone, finish what the pool and the accept loop handed them, pooled connections are free'd here
   for (uint8_t i = 0; i < WS_MAX_THREADS; i++)
-    if (socketInfo->threads[i].thread != 0)
-      pthread_cancel(socketInfo->threads[i].thread);
+    if (socketInfo->threads[i].completionFD > 0)
+      drainCompletions(&(socketInfo->threads[i]));
+
+  if (socketInfo->hasHandlerPool)
+    freeTaskPool(&(socketInfo->handlerPool));
+
+  if (socketInfo->connections != NULL) {
+    for (int32_t i = 0; i < WS_MAX_CONNECTIONS; i++) {
+      WSConnection * const connection = &(socketInfo->connections[i]);
+      if (memcmp(connection, &nullConn, sizeof(WSConnection)) == 0)
+        continue;
+      // Inline connections, their workers are joined so onDisconnect can run right here
+      if (!connection->needsHandshake && connection->pathHanlder != NULL)
+        connection->pathHanlder->onDisconnect(connection);
+      freeConnectionResources(socketInfo, connection, 1001);
+    }
+  }
+
+  free(socketInfo->connections);
+
+  for (uint8_t i = 0; i < WS_MAX_THREADS; i++) {
+    if (socketInfo->threads[i].completionFD > 0)
+      close(socketInfo->threads[i].completionFD);
+    free(socketInfo->threads[i].queuedFDs);
+    free(socketInfo->threads[i].readBuffer);
+    free(socketInfo->threads[i].batch);
+    freeArena(&(socketInfo->threads[i].replyArena));
+    while (socketInfo->threads[i].retiredBroadcasts != NULL) {
+      WSHandlerTask * const retired = socketInfo->threads[i].retiredBroadcasts;
+      socketInfo->threads[i].retiredBroadcasts = retired->nextCompletion;
+      releaseBroadcast(retired);
+    }
+    free(socketInfo->threads[i].routeMembers);
+  }
+
+  if (socketInfo->hasBus)
+    freeBus(&(socketInfo->bus));
+
+  // Last, the connections closed above are still recorded
+  if (socketInfo->isCapturing)
+    freeCapture(&(socketInfo->capture));
+  free(socketInfo->capturePath);
+  freeTraceWriter(&(socketInfo->traceWriter));
+  free(socketInfo->tracePath);
+
+  freeAdmissionTable(&(socketInfo->rateLimits));
 
-  mapForEach(&(socketInfo->paths), NULL, freeConnectionPathForEachWrapper);
-  freeMap(&(socketInfo->paths));
+  if (socketInfo->routes != NULL) {
+    freeRouteTable(socketInfo->routes);
+    freeEpochDomain(&(socketInfo->routeEpochs));
+    pthread_mutex_destroy(&(socketInfo->routeLock));
+  }
   
-  shutdown(socketInfo->socketFD, SHUT_RDWR);
-  close(socketInfo->socketFD);
+  for (uint8_t i = 0; i < socketInfo->listenerCount; i++) {
+    WSListener * const listener = &(socketInfo->listeners[i]);
+    close(listener->listenerFD);
+
+    struct sockaddr_un const * const addrUnix = (struct sockaddr_un const *)&(listener->addrInfo);
+    // The socket file belongs to the whole cluster, only the first process removes it
+    if (listener->addrInfo.ss_family == AF_UNIX && addrUnix->sun_path[0] != '\0' && socketInfo->clusterIndex == 0)
+      unlink(addrUnix->sun_path);
+  }
+  if (socketInfo->socketEventPoll > 0)
+    close(socketInfo->socketEventPoll);
 
   memset(socketInfo, 0, sizeof(WSSocket));
   socketInfo = NULL;
@@ -528,22 +2060,548 @@ int8_t addValidPath(WSSocket * const socketInfo, char const * const path,
     void (*onHandshake)(WSConnection const * const client),
     void (*onDisconnect)(WSConnection const * const client),
     size_t (*onMessage)(WSConnection const * const client, char const * const incData, char ** const outData)) {
-  if (mapGet(&(socketInfo->paths), (void*)path) != NULL)
+  int8_t result = -1;
+  pthread_mutex_lock(&(socketInfo->routeLock));
+  if (findPath(socketInfo, dstrviewof(path, strlen(path))) != NULL)
+    goto exit;
+
+  WSRouteTable * const routes = copyRoutes(socketInfo, NULL, NULL);
+  if (routes == NULL)
+    goto exit;
+  WSPathHandler * pathHandler = calloc(1, sizeof(WSPathHandler));
+  DString pathDStr;
+  if (pathHandler == NULL || dstrinit(&pathDStr, path, strlen(path)) == NULL) {
+    free(pathHandler);
+    freeRouteTable(routes);
+    goto exit;
+  }
+  pathHandler->onHandshake = onHandshake;
+  pathHandler->onDisconnect = onDisconnect;
+  pathHandler->onMessage = onMessage;
+  pathHandler->routeID = ++(socketInfo->lastRouteID);
+  atomic_init(&(pathHandler->references), 1);
+  mapPut(&(routes->paths), &pathDStr, &pathHandler);
+
+  publishRoutes(socketInfo, routes);
+  result = 0;
+
+  exit:
+  pthread_mutex_unlock(&(socketInfo->routeLock));
+  return result;
+}
+
+int8_t removeValidPath(WSSocket * const socketInfo, char const * const path) {
+  DStringView const pathView = dstrviewof(path, strlen(path));
+  uint8_t skipped = 0;
+
+  pthread_mutex_lock(&(socketInfo->routeLock));
+  WSRouteTable * const routes = copyRoutes(socketInfo, &pathView, &skipped);
+  if (routes != NULL && skipped)
+    publishRoutes(socketInfo, routes);
+  else if (routes != NULL)
+    freeRouteTable(routes);
+  pthread_mutex_unlock(&(socketInfo->routeLock));
+
+  return (routes != NULL && skipped) ? 0 : -1;
+}
+
+// Republishes path with a copy of its handler that apply has changed, connections already on it keep the old one.
+// Returns 0 on success, -1 otherwise (also when apply refuses the change)
+static int8_t changePath(WSSocket * const socketInfo, char const * const path,
+    int8_t (*apply)(WSSocket const * const socketInfo, WSPathHandler * const changed, WSPathHandler const * const wanted), WSPathHandler const * const wanted) {
+  int8_t result = -1;
+  pthread_mutex_lock(&(socketInfo->routeLock));
+  DStringView const pathView = dstrviewof(path, strlen(path));
+  WSPathHandler const * const current = findPath(socketInfo, pathView);
+  if (current == NULL)
+    goto exit;
+
+  WSPathHandler * const changed = malloc(sizeof(WSPathHandler));
+  if (changed == NULL)
+    goto exit;
+  // Field by field, references of the current one may be changing under us
+  changed->onHandshake = current->onHandshake;
+  changed->onDisconnect = current->onDisconnect;
+  changed->onMessage = current->onMessage;
+  changed->onMessageBatch = current->onMessageBatch;
+  changed->execMode = current->execMode;
+  changed->routeID = current->routeID;
+  atomic_init(&(changed->references), 1);
+
+  WSRouteTable * routes = NULL;
+  if (apply(socketInfo, changed, wanted) == -1 || (routes = copyRoutes(socketInfo, NULL, NULL)) == NULL) {
+    free(changed);
+    goto exit;
+  }
+  WSPathHandler ** const slot = mapGetAs(&(routes->paths), (void *)&pathView, comparePathView, hashView);
+  releasePathHandler(*slot);
+  *slot = changed;
+
+  publishRoutes(socketInfo, routes);
+  result = 0;
+
+  exit:
+  pthread_mutex_unlock(&(socketInfo->routeLock));
+  return result;
+}
+
+static int8_t applyExecMode(WSSocket const * const socketInfo, WSPathHandler * const changed, WSPathHandler const * const wanted) {
+  // The handler pool is only started by runSocketLoop
+  if (wanted->execMode == WS_EXEC_POOLED && socketInfo->isRouting && !socketInfo->hasHandlerPool)
     return -1;
-  WSPathHandler pathHandler = {
-    .onHandshake = onHandshake,
-    .onDisconnect = onDisconnect,
-    .onMessage = onMessage
+  changed->execMode = wanted->execMode;
+  return 0;
+}
+
+static int8_t applyBatchHandler(WSSocket const * const socketInfo, WSPathHandler * const changed, WSPathHandler const * const wanted) {
+  (void)socketInfo; //unused
+
+  changed->onMessageBatch = wanted->onMessageBatch;
+  return 0;
+}
+
+int8_t setPathExecution(WSSocket * const socketInfo, char const * const path, WSExecMode const mode) {
+  WSPathHandler const wanted = {
+    .execMode = mode
   };
-  DString pathDStr;
-  dstrinit(&pathDStr, path, strlen(path) + 1);
-  mapPut(&(socketInfo->paths), &pathDStr, &pathHandler);
+  return changePath(socketInfo, path, applyExecMode, &wanted);
+}
+
+int8_t setPathBatchHandler(WSSocket * const socketInfo, char const * const path,
+    void (*onMessageBatch)(WSConnection const * const client, WSMessageView const * const messages, uint32_t const count)) {
+  WSPathHandler const wanted = {
+    .onMessageBatch = onMessageBatch
+  };
+  return changePath(socketInfo, path, applyBatchHandler, &wanted);
+}
+
+char * getReplyBuffer(WSConnection const * const client, size_t const size) {
+  if (replySink.client == NULL || replySink.client != client)
+    return NULL;
+
+  char * memory;
+  if (replySink.isPooled) {
+    if (replySink.reserved != NULL)
+      free(replySink.reserved - WS_FRAME_HEADER_MAX);
+    memory = malloc(WS_FRAME_HEADER_MAX + size);
+  } else {
+    memory = arenaAlloc(&(replySink.worker->replyArena), WS_FRAME_HEADER_MAX + size);
+  }
+
+  if (memory == NULL) {
+    replySink.reserved = NULL;
+    return NULL;
+  }
+  replySink.reserved = memory + WS_FRAME_HEADER_MAX;
+  replySink.reservedSize = size;
+  return replySink.reserved;
+}
+
+int8_t commitReply(WSConnection const * const client, size_t const size) {
+  if (replySink.client == NULL || replySink.client != client || replySink.reserved == NULL || size > replySink.reservedSize)
+    return -1;
+
+  char * const payload = replySink.reserved;
+  replySink.reserved = NULL;
+
+  if (replySink.isPooled) {
+    WSHandlerTask * reply = newHandlerTask(replySink.worker, replySink.client, WS_TASK_REPLY);
+    if (reply == NULL) {
+      free(payload - WS_FRAME_HEADER_MAX);
+      return -1;
+    }
+    reply->data = payload - WS_FRAME_HEADER_MAX;
+    reply->size = size;
+    postCompletion(replySink.worker, reply);
+    return 0;
+  }
+
+  char * const frame = encodeInPlace(payload, WS_OPCODE_TEXT, size);
+  return queueEncodedFrame(replySink.worker, replySink.client, frame, payload + size - frame, WS_PAYLOAD_BATCH, NULL);
+}
+
+void setUserContext(WSConnection const * const client, void * const context) {
+  ((WSConnection *)client)->userContext = context;
+}
+
+void * getUserContext(WSConnection const * const client) {
+  return client->userContext;
+}
+
+void * allocSessionMemory(WSConnection const * const client, size_t const size) {
+  if (replySink.client == NULL || replySink.client != client)
+    return NULL;
+  return arenaAlloc(&(replySink.client->sessionArena), size);
+}
+
+static int8_t startStream(WSConnection const * const client, int32_t const fileFD, off_t const offset, char const * const region,
+    size_t const length, uint8_t const isBinary, void (*onDone)(WSConnection const * const, void * const, int8_t const), void * const context) {
+  if (replySink.client == NULL || replySink.client != client)
+    return -1;
+
+  WSStream * const stream = calloc(1, sizeof(WSStream));
+  if (stream == NULL)
+    return -1;
+  stream->fileFD = fileFD;
+  stream->fileOffset = offset;
+  stream->region = region;
+  stream->length = length;
+  stream->chunkSize = replySink.worker->socket->streamChunkSize;
+  stream->opcode = isBinary ? WS_OPCODE_BINARY : WS_OPCODE_TEXT;
+  stream->onDone = onDone;
+  stream->context = context;
+
+  if (replySink.isPooled) {
+    WSHandlerTask * const handlerTask = newHandlerTask(replySink.worker, replySink.client, WS_TASK_STREAM);
+    if (handlerTask == NULL) {
+      free(stream);
+      return -1;
+    }
+    handlerTask->data = (char *)stream;
+    postCompletion(replySink.worker, handlerTask);
+    return 0;
+  }
+
+  if (queueStream(replySink.worker, replySink.client, stream) == -1) {
+    free(stream);
+    return -1;
+  }
+  return 0;
+}
+
+int8_t streamFile(WSConnection const * const client, int32_t const fileFD, off_t const offset, size_t const length, uint8_t const isBinary,
+    void (*onDone)(WSConnection const * const client, void * const context, int8_t const status), void * const context) {
+  if (fileFD < 0 || offset < 0)
+    return -1;
+  return startStream(client, fileFD, offset, NULL, length, isBinary, onDone, context);
+}
+
+int8_t streamRegion(WSConnection const * const client, void const * const region, size_t const length, uint8_t const isBinary,
+    void (*onDone)(WSConnection const * const client, void * const context, int8_t const status), void * const context) {
+  if (region == NULL && length > 0)
+    return -1;
+  return startStream(client, -1, 0, region, length, isBinary, onDone, context);
+}
+
+void setStreamChunking(WSSocket * const socketInfo, size_t const chunkSize) {
+  socketInfo->streamChunkSize = chunkSize;
+}
+
+void setOutputCoalescing(WSSocket * const socketInfo, size_t const maxBytes, uint32_t const maxDelayUs) {
+  socketInfo->coalesceMaxBytes = maxBytes;
+  socketInfo->coalesceMaxDelayUs = maxDelayUs;
+}
+
+int8_t setAdmissionControl(WSSocket * const socketInfo, WSAdmission const * const admission) {
+  freeAdmissionTable(&(socketInfo->rateLimits));
+  if (admission->connectionsPerSecond > 0) {
+    double const burst = (admission->connectionBurst < 1) ? 1 : admission->connectionBurst;
+    if (initAdmissionTable(&(socketInfo->rateLimits), WS_ADMISSION_BUCKETS, admission->connectionsPerSecond, burst) == -1) {
+      printf("Could not allocate rate limit table\n");
+      return -1;
+    }
+  }
+
+  memcpy(&(socketInfo->admission), admission, sizeof(WSAdmission));
+  if (socketInfo->admission.acceptBudget == 0)
+    socketInfo->admission.acceptBudget = 1;
+  if (socketInfo->admission.backlog == 0)
+    socketInfo->admission.backlog = WS_SOCKET_BACKLOG;
+  if (socketInfo->admission.handshakeTimeoutMs == 0)
+    socketInfo->admission.handshakeTimeoutMs = WS_HANDSHAKE_TIMEOUT_MS;
+  return 0;
+}
+
+int8_t enableCapture(WSSocket * const socketInfo, char const * const path) {
+  if (socketInfo->capturePath != NULL || createCaptureFile(path) == -1) {
+    printf("Could not create capture file \"%s\"\n", path);
+    return -1;
+  }
+
+  if ((socketInfo->capturePath = strdup(path)) == NULL)
+    return -1;
+  return 0;
+}
+
+int8_t enableTracing(WSSocket * const socketInfo, uint32_t const sampleEvery, char const * const tracePath) {
+  if (socketInfo->threads[0].readBuffer != NULL)
+    return -1;
+
+  free(socketInfo->tracePath);
+  socketInfo->tracePath = NULL;
+  if (tracePath != NULL && (socketInfo->tracePath = strdup(tracePath)) == NULL)
+    return -1;
+  socketInfo->traceSampleEvery = sampleEvery;
+  return 0;
+}
+
+void writeLatencyReport(WSSocket * const socketInfo, FILE * const out) {
+  TraceHistograms merged;
+  memset(&merged, 0, sizeof(TraceHistograms));
+  for (uint8_t i = 0; i < WS_MAX_THREADS; i++)
+    traceMergeHistograms(&merged, &(socketInfo->threads[i].traceHistograms));
+  traceWriteHistograms(&merged, out);
+}
+
+int8_t setBusyPolling(WSSocket * const socketInfo, WSBusyPoll const * const busyPoll) {
+  if (socketInfo->threads[0].readBuffer != NULL)
+    return -1;
+
+  // Raising SO_BUSY_POLL past net.core.busy_read needs CAP_NET_ADMIN, find out now rather than per connection
+  if (busyPoll->socketBusyPollMicros != 0 || busyPoll->preferBusyPoll) {
+    int32_t const probeFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probeFD == -1)
+      return -1;
+    int32_t const enable = 1;
+    int8_t result = 0;
+    if (busyPoll->socketBusyPollMicros != 0
+        && setsockopt(probeFD, SOL_SOCKET, SO_BUSY_POLL, &(busyPoll->socketBusyPollMicros), sizeof(busyPoll->socketBusyPollMicros)) == -1) {
+      printf("Could not enable SO_BUSY_POLL: %s\n", strerror(errno));
+      result = -1;
+    }
+    if (busyPoll->preferBusyPoll && setsockopt(probeFD, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable)) == -1) {
+      printf("Could not enable SO_PREFER_BUSY_POLL: %s\n", strerror(errno));
+      result = -1;
+    }
+    close(probeFD);
+    if (result == -1)
+      return -1;
+  }
+
+  // Two spinning workers on one core only take turns burning it
+  for (uint8_t i = 0; busyPoll->pinWorkers && i < WS_MAX_THREADS; i++) {
+    if (busyPoll->cpus[i] < 0)
+      continue;
+    if (busyPoll->cpus[i] >= CPU_SETSIZE) {
+      printf("Could not pin worker %d to core %d: no such core\n", i, busyPoll->cpus[i]);
+      return -1;
+    }
+    for (uint8_t j = 0; j < i; j++) {
+      if (busyPoll->cpus[j] == busyPoll->cpus[i]) {
+        printf("Could not pin workers %d and %d to the same core %d\n", j, i, busyPoll->cpus[i]);
+        return -1;
+      }
+    }
+  }
+
+  memcpy(&(socketInfo->busyPoll), busyPoll, sizeof(WSBusyPoll));
+  return 0;
+}
+
+void writeWorkerReport(WSSocket * const socketInfo, FILE * const out) {
+  for (uint8_t i = 0; i < WS_MAX_THREADS; i++) {
+    WSWorkerStats const * const stats = &(socketInfo->threads[i].stats);
+    double const total = (stats->busyNanos + stats->spinNanos + stats->blockNanos) / 100.0;
+    if (total == 0) {
+      fprintf(out, "Worker %d: not started\n", i);
+      continue;
+    }
+    fprintf(out, "Worker %d: busy %.1f%%, spinning %.1f%%, blocked %.1f%%, %lu wakeups while spinning, %lu from sleep\n", i,
+        stats->busyNanos / total, stats->spinNanos / total, stats->blockNanos / total,
+        (unsigned long)stats->spinWakeups, (unsigned long)stats->blockWakeups);
+  }
+}
+
+int8_t setMemoryPolicy(WSSocket * const socketInfo, WSMemoryPolicy const * const policy) {
+  if (policy->readBufferSize < WS_READ_BUFFER_MIN || socketInfo->threads[0].readBuffer != NULL)
+    return -1;
+
+  memcpy(&(socketInfo->memory), policy, sizeof(WSMemoryPolicy));
+  if (socketInfo->memory.maxMessageSize == 0)
+    socketInfo->memory.maxMessageSize = WS_MAX_MESSAGE_SIZE;
+  return 0;
+}
+
+size_t getConnectionMemory(WSConnection const * const client) {
+  size_t bytes = sizeof(WSConnection) + client->partialCapacity + client->outCapacity * sizeof(WSOutFrame);
+  for (uint32_t i = 0; i < client->outCount; i++)
+    if (client->outFrames[i].ownership == WS_PAYLOAD_OWNED)
+      bytes += client->outFrames[i].length;
+    else if (client->outFrames[i].ownership == WS_PAYLOAD_STREAM)
+      bytes += sizeof(WSStream);
+  if (client->strand != NULL)
+    bytes += sizeof(TaskStrand);
+  return bytes + client->sessionArena.allocated;
+}
+
+int8_t setClusterMode(WSSocket * const socketInfo, uint8_t const processes) {
+  if (processes == 0 || processes > BUS_MAX_PROCESSES || socketInfo->listenerCount != 0)
+    return -1;
+
+  socketInfo->clusterProcesses = processes;
+  return 0;
+}
+
+int8_t broadcastMessage(WSSocket * const socketInfo, char const * const path, char const * const data, size_t const size) {
+  if (!socketInfo->hasBus)
+    return -1;
+
+  // Records are the path prefixed by its length, then the payload
+  size_t const fullPathLength = strlen(path);
+  if (fullPathLength > UINT16_MAX)
+    return -1;
+  uint16_t const pathLength = fullPathLength;
+  struct iovec parts[3] = {
+    { .iov_base = (void *)&pathLength, .iov_len = sizeof(pathLength) },
+    { .iov_base = (void *)path, .iov_len = pathLength },
+    { .iov_base = (void *)data, .iov_len = size }
+  };
+  return busPublish(&(socketInfo->bus), parts, 3);
+}
+
+// Runs on the accept thread for every record on the bus, hands it to each worker
+static void routeBroadcast(uint8_t const * data, uint32_t length, void * context) {
+  WSSocket * const socketInfo = context;
+
+  uint16_t pathLength;
+  if (length < sizeof(pathLength))
+    return;
+  memcpy(&pathLength, data, sizeof(pathLength));
+  if (length - sizeof(pathLength) < pathLength)
+    return;
+
+  WSPathHandler * const pathHandler = findPath(socketInfo, dstrviewof((char const *)data + sizeof(pathLength), pathLength));
+  if (pathHandler == NULL)
+    return;
+
+  // The ring space can be reused once this returns, so the payload is copied out once for every worker to share
+  size_t const size = length - sizeof(pathLength) - pathLength;
+  WSBroadcast * const broadcast = malloc(sizeof(WSBroadcast) + size);
+  if (broadcast == NULL) {
+    printf("(Server): Could not allocate broadcast, dropping it.\n");
+    return;
+  }
+  memcpy(broadcast->payload, (char const *)data + sizeof(pathLength) + pathLength, size);
+  atomic_init(&(broadcast->references), WS_MAX_THREADS);
+
+  for (uint8_t i = 0; i < WS_MAX_THREADS; i++) {
+    WSHandlerTask * const handlerTask = &(broadcast->tasks[i]);
+    memset(handlerTask, 0, sizeof(WSHandlerTask));
+    handlerTask->worker = &(socketInfo->threads[i]);
+    handlerTask->kind = WS_TASK_BROADCAST;
+    handlerTask->routeID = pathHandler->routeID;
+    handlerTask->data = broadcast->payload;
+    handlerTask->size = size;
+    postCompletion(&(socketInfo->threads[i]), handlerTask);
+  }
+}
+
+// Forks the rest of the cluster, must run before any thread exists. Returns 0 on success, -1 otherwise
+static int8_t startCluster(WSSocket * const socketInfo) {
+  uint8_t const processes = (socketInfo->clusterProcesses == 0) ? 1 : socketInfo->clusterProcesses;
+  if (initBus(&(socketInfo->bus), WS_BUS_CAPACITY, processes) == -1) {
+    printf("Could not create broadcast bus: %s\n", strerror(errno));
+    return -1;
+  }
+  socketInfo->hasBus = 1;
+
+  for (uint8_t i = 1; i < processes; i++) {
+    pid_t const pid = fork();
+    if (pid == -1) {
+      printf("Could not fork cluster process %d: %s\n", i, strerror(errno));
+      break;
+    }
+    if (pid == 0) {
+      memset(socketInfo->clusterPIDs, 0, sizeof(socketInfo->clusterPIDs));
+      socketInfo->clusterIndex = i;
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      break;
+    }
+    socketInfo->clusterPIDs[i] = pid;
+  }
+  busAttach(&(socketInfo->bus), socketInfo->clusterIndex);
+
+  if (socketInfo->clusterIndex == 0)
+    return 0;
+
+  // The inherited epoll instance is shared with the parent, and each process needs its own accept queues
+  close(socketInfo->socketEventPoll);
+  if ((socketInfo->socketEventPoll = epoll_create1(0)) == -1) {
+    printf("Could not create event poll for cluster process %d: %s\n", socketInfo->clusterIndex, strerror(errno));
+    return -1;
+  }
+  for (uint8_t i = 0; i < socketInfo->listenerCount; i++) {
+    WSListener * const listener = &(socketInfo->listeners[i]);
+    if (listener->addrInfo.ss_family == AF_UNIX)
+      continue; // No SO_REUSEPORT for these, the inherited socket is shared instead
+    int32_t const listenerFD = openListener(socketInfo, &(listener->addrInfo), listener->addrLength, listener->v6Only);
+    if (listenerFD == -1)
+      return -1;
+    close(listener->listenerFD);
+    listener->listenerFD = listenerFD;
+  }
+  return 0;
+}
+
+// Shared Unix sockets wake a single process per connection instead of the whole cluster
+static int8_t trackListeners(WSSocket * const socketInfo) {
+  for (uint8_t i = 0; i < socketInfo->listenerCount; i++) {
+    WSListener * const listener = &(socketInfo->listeners[i]);
+    struct epoll_event socketEvent = {
+      .data.fd = listener->listenerFD,
+      .events = EPOLLIN | ((socketInfo->clusterProcesses > 1 && listener->addrInfo.ss_family == AF_UNIX) ? EPOLLEXCLUSIVE : 0)
+    };
+    if (epoll_ctl(socketInfo->socketEventPoll, EPOLL_CTL_ADD, listener->listenerFD, &socketEvent) == -1) {
+      char addr[WS_ADDRSTRLEN];
+      formatAddress(&(listener->addrInfo), listener->addrLength, addr);
+      printf("Could not track event for %s: %s\n", addr, strerror(errno));
+      return -1;
+    }
+  }
+
+  struct epoll_event busEvent = {
+    .data.fd = busWakeFD(&(socketInfo->bus)),
+    .events = EPOLLIN
+  };
+  if (epoll_ctl(socketInfo->socketEventPoll, EPOLL_CTL_ADD, busWakeFD(&(socketInfo->bus)), &busEvent) == -1) {
+    printf("Could not track broadcast bus: %s\n", strerror(errno));
+    return -1;
+  }
   return 0;
 }
 
 void runSocketLoop(WSSocket * const socketInfo, void (*onConnect)(WSConnection const * const client)) {
   uint8_t nextWorker = 0;
 
+  if (startCluster(socketInfo) == -1 || trackListeners(socketInfo) == -1)
+    return;
+
+  // The writer thread has to be started in each process, ids are kept apart by the process index
+  if (socketInfo->capturePath != NULL) {
+    if (initCapture(&(socketInfo->capture), socketInfo->capturePath, WS_CAPTURE_BUFFER, (uint32_t)socketInfo->clusterIndex << 24) == -1) {
+      printf("Could not start capture to \"%s\": %s\n", socketInfo->capturePath, strerror(errno));
+      return;
+    }
+    socketInfo->isCapturing = 1;
+  }
+
+  if (socketInfo->traceSampleEvery != 0 && socketInfo->tracePath != NULL) {
+    char tracePath[PATH_MAX];
+    if (socketInfo->clusterIndex == 0)
+      snprintf(tracePath, sizeof(tracePath), "%s", socketInfo->tracePath);
+    else
+      snprintf(tracePath, sizeof(tracePath), "%s.%d", socketInfo->tracePath, socketInfo->clusterIndex);
+    if (initTraceWriter(&(socketInfo->traceWriter), tracePath) == -1) {
+      printf("Could not open trace file \"%s\": %s\n", tracePath, strerror(errno));
+      return;
+    }
+  }
+
+  // Held until the pool question is settled, a path made pooled meanwhile must not be left without one
+  uint8_t needsHandlerPool = 0;
+  pthread_mutex_lock(&(socketInfo->routeLock));
+  mapForEach(&(atomic_load(&(socketInfo->routes))->paths), &needsHandlerPool, hasPooledPathForEachWrapper);
+  if (needsHandlerPool) {
+    if (initTaskPool(&(socketInfo->handlerPool), WS_POOL_THREADS) == -1) {
+      pthread_mutex_unlock(&(socketInfo->routeLock));
+      printf("Could not start handler pool\n");
+      return;
+    }
+    socketInfo->hasHandlerPool = 1;
+  }
+  socketInfo->isRouting = 1;
+  pthread_mutex_unlock(&(socketInfo->routeLock));
+
   for (int32_t i = 0; i < WS_MAX_THREADS; i++) {
     socketInfo->threads[i].socket = socketInfo;
 
@@ -551,18 +2609,76 @@ void runSocketLoop(WSSocket * const socketInfo, void (*onConnect)(WSConnection c
       printf("Could not create event poll for thread %d: %s\n", i, strerror(errno));
       return;
     }
+
+    if ((socketInfo->threads[i].completionFD = eventfd(0, EFD_NONBLOCK)) == -1) {
+      printf("Could not create completion queue for thread %d: %s\n", i, strerror(errno));
+      return;
+    }
+    pthread_mutex_init(&(socketInfo->threads[i].completionLock), NULL);
+
+    if ((socketInfo->threads[i].queuedFDs = calloc(WS_MAX_CONNECTIONS, sizeof(int32_t))) == NULL) {
+      printf("Could not allocate output queue for thread %d\n", i);
+      return;
+    }
+    // One spare byte so the last payload in the buffer can still be NUL terminated
+    if ((socketInfo->threads[i].readBuffer = malloc(socketInfo->memory.readBufferSize + 1)) == NULL) {
+      printf("Could not allocate read buffer for thread %d\n", i);
+      return;
+    }
+    if ((socketInfo->threads[i].batch = malloc(WS_MESSAGE_BATCH_MAX * sizeof(WSMessageView))) == NULL) {
+      printf("Could not allocate message batch for thread %d\n", i);
+      return;
+    }
+    initArena(&(socketInfo->threads[i].replyArena), WS_REPLY_ARENA_CHUNK);
+    socketInfo->threads[i].traceCountdown = socketInfo->traceSampleEvery;
+    socketInfo->threads[i].firstHandshake = -1;
+    socketInfo->threads[i].lastHandshake = -1;
+
+    struct epoll_event completionEvent = {
+      .data.fd = socketInfo->threads[i].completionFD,
+      .events = EPOLLIN
+    };
+    if (epoll_ctl(socketInfo->threads[i].workerEventPoll, EPOLL_CTL_ADD, socketInfo->threads[i].completionFD, &completionEvent) == -1) {
+      printf("Could not track completions for thread %d: %s\n", i, strerror(errno));
+      return;
+    }
     
     pthread_create(&(socketInfo->threads[i].thread), NULL, threadLoop, &(socketInfo->threads[i]));
+
+    // Spinning workers want a core of their own, ideally one kept clear with isolcpus
+    if (socketInfo->busyPoll.pinWorkers && socketInfo->busyPoll.cpus[i] >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(socketInfo->busyPoll.cpus[i], &cpus);
+      if (pthread_setaffinity_np(socketInfo->threads[i].thread, sizeof(cpu_set_t), &cpus) != 0)
+        printf("Could not pin thread %d to core %d\n", i, socketInfo->busyPoll.cpus[i]);
+    }
   }
 
   struct epoll_event eventsTriggered[WS_EVENTS_PER_LOOP];
   for (;;) {
+    epochOffline(&(socketInfo->routeEpochs), WS_ACCEPT_READER);
     int32_t events = epoll_wait(socketInfo->socketEventPoll, eventsTriggered, WS_EVENTS_PER_LOOP, -1);
+    epochQuiescent(&(socketInfo->routeEpochs), WS_ACCEPT_READER);
     for (int32_t i = 0; i < events; i++) {
-      WSConnection client;
-      acceptNewConnection(socketInfo, &client, nextWorker++);
-      onConnect(&(socketInfo->connections[client.clientFD]));
-      nextWorker %= 4;
+      if (eventsTriggered[i].data.fd == busWakeFD(&(socketInfo->bus))) {
+        uint64_t const skips = busConsume(&(socketInfo->bus), socketInfo, routeBroadcast);
+        if (skips > 0)
+          printf("(Server): Fell behind on the broadcast bus, lost messages %lu time(s).\n", (unsigned long)skips);
+        continue;
+      }
+
+      // Drain the backlog in one go, a listener left with pending connections stays readable for the next round
+      for (uint32_t accepted = 0; accepted < socketInfo->admission.acceptBudget; accepted++) {
+        WSConnection client;
+        int8_t result = acceptNewConnection(socketInfo, eventsTriggered[i].data.fd, &client, nextWorker);
+        if (result == -1)
+          break;
+        if (result == 1)
+          continue;
+        onConnect(&(socketInfo->connections[client.clientFD]));
+        nextWorker = (nextWorker + 1) % WS_MAX_THREADS;
+      }
     }
   }
 }
@@ -0,0 +1,16 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//Stops the test on the first broken expectation, ctest only looks at the exit status
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      fflush(stdout); \
+      abort(); \
+    } \
+  } while (0)
+
+#endif
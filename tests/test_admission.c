@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "admission.h"
+#include "test.h"
+
+#define SECOND 1000000ull
+
+static void makeAddress(uint8_t address[ADMISSION_ADDRESS_SIZE], uint32_t ipv4) {
+  memset(address, 0, ADMISSION_ADDRESS_SIZE);
+  address[10] = 0xFF;
+  address[11] = 0xFF;
+  address[12] = ipv4 >> 24;
+  address[13] = ipv4 >> 16;
+  address[14] = ipv4 >> 8;
+  address[15] = ipv4;
+}
+
+static void testArguments(void) {
+  AdmissionTable table;
+  CHECK(initAdmissionTable(&table, 0, 10, 5) == -1);
+  CHECK(initAdmissionTable(&table, 16, 0, 5) == -1);
+  CHECK(initAdmissionTable(&table, 16, 10, 0.5) == -1);
+
+  CHECK(initAdmissionTable(&table, 100, 10, 5) == 0);
+  CHECK(table.capacity == 128);
+  freeAdmissionTable(&table);
+}
+
+static void testBurstAndRefill(void) {
+  AdmissionTable table;
+  CHECK(initAdmissionTable(&table, 64, 10, 3) == 0);
+
+  uint8_t address[ADMISSION_ADDRESS_SIZE];
+  makeAddress(address, 0x0A000001);
+  uint64_t now = 5 * SECOND;
+
+  //A fresh address gets the whole burst straight away and nothing after it
+  for (uint32_t i = 0; i < 3; i++)
+    CHECK(admissionTake(&table, address, now) == 1);
+  CHECK(admissionTake(&table, address, now) == 0);
+
+  //10 per second is one token every 100ms
+  CHECK(admissionTake(&table, address, now + SECOND / 20) == 0);
+  CHECK(admissionTake(&table, address, now + SECOND / 10) == 1);
+  CHECK(admissionTake(&table, address, now + SECOND / 10) == 0);
+
+  //Denied attempts still move lastSeen, half a token only ever adds up to one with the next half
+  now += SECOND / 10;
+  CHECK(admissionTake(&table, address, now + SECOND / 20) == 0);
+  CHECK(admissionTake(&table, address, now + SECOND / 10) == 1);
+  now += SECOND / 10;
+
+  //Refill caps at the burst however long the address was away
+  now += 10 * SECOND;
+  for (uint32_t i = 0; i < 3; i++)
+    CHECK(admissionTake(&table, address, now) == 1);
+  CHECK(admissionTake(&table, address, now) == 0);
+
+  //Half a token short of a full refill leaves two and a half
+  now += table.refillMicros - SECOND / 20;
+  CHECK(admissionTake(&table, address, now) == 1);
+  CHECK(admissionTake(&table, address, now) == 1);
+  CHECK(admissionTake(&table, address, now) == 0);
+
+  freeAdmissionTable(&table);
+}
+
+static void testIndependentAddresses(void) {
+  AdmissionTable table;
+  CHECK(initAdmissionTable(&table, 1024, 1, 2) == 0);
+
+  uint64_t const now = SECOND;
+  uint8_t address[ADMISSION_ADDRESS_SIZE];
+  for (uint32_t ip = 1; ip <= 200; ip++) {
+    makeAddress(address, 0xC0A80000 + ip);
+    CHECK(admissionTake(&table, address, now) == 1);
+    CHECK(admissionTake(&table, address, now) == 1);
+    CHECK(admissionTake(&table, address, now) == 0);
+  }
+
+  //The same IPv4 address as plain IPv6 bytes is a different client
+  makeAddress(address, 0xC0A80001);
+  memset(address + 10, 0, 2);
+  CHECK(admissionTake(&table, address, now) == 1);
+
+  freeAdmissionTable(&table);
+}
+
+static void testFullWindowEvictsOldest(void) {
+  AdmissionTable table;
+  //Eight buckets, so every address probes the whole table
+  CHECK(initAdmissionTable(&table, 8, 1, 1) == 0);
+
+  uint8_t address[ADMISSION_ADDRESS_SIZE];
+  uint64_t now = SECOND;
+  for (uint32_t ip = 1; ip <= 8; ip++) {
+    makeAddress(address, ip);
+    CHECK(admissionTake(&table, address, now++) == 1);
+    CHECK(admissionTake(&table, address, now++) == 0);
+  }
+
+  //A ninth address takes the least recently seen bucket, that one's owner starts over with a full bucket
+  makeAddress(address, 9);
+  CHECK(admissionTake(&table, address, now++) == 1);
+  makeAddress(address, 1);
+  CHECK(admissionTake(&table, address, now++) == 1);
+
+  //The rest kept their history, apart from 2 which address 1 pushed out in turn
+  for (uint32_t ip = 3; ip <= 8; ip++) {
+    makeAddress(address, ip);
+    CHECK(admissionTake(&table, address, now++) == 0);
+  }
+
+  freeAdmissionTable(&table);
+}
+
+int main(void) {
+  testArguments();
+  testBurstAndRefill();
+  testIndependentAddresses();
+  testFullWindowEvictsOldest();
+  printf("admission: ok\n");
+  return 0;
+}
@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bus.h"
+#include "test.h"
+
+#define RING_SIZE 4096
+#define PRODUCERS 3
+#define RECORDS_PER_PRODUCER 20000
+#define MAX_BODY 500
+#define RACING_RING_SIZE (64 * 1024)
+
+typedef struct {
+  uint32_t producer;
+  uint32_t sequence;
+} RecordHead;
+
+//Per producer next sequence the reader expects, plus what it saw overall
+typedef struct {
+  uint32_t expected[PRODUCERS];
+  uint64_t delivered;
+  uint8_t isStrict; // Every sequence must show up, not just in increasing order
+} ReadLog;
+
+static uint32_t bodySize(uint32_t producer, uint32_t sequence) {
+  return (sequence * 37 + producer * 11) % MAX_BODY;
+}
+
+static uint8_t bodyByte(uint32_t producer, uint32_t sequence, uint32_t i) {
+  return (uint8_t)(producer * 7 + sequence + i);
+}
+
+static void publishRecord(Bus * bus, uint32_t producer, uint32_t sequence) {
+  static _Thread_local uint8_t body[MAX_BODY];
+  uint32_t const size = bodySize(producer, sequence);
+  for (uint32_t i = 0; i < size; i++)
+    body[i] = bodyByte(producer, sequence, i);
+
+  RecordHead const head = { .producer = producer, .sequence = sequence };
+  struct iovec const parts[2] = {
+    { .iov_base = (void *)&head, .iov_len = sizeof(head) },
+    { .iov_base = body, .iov_len = size }
+  };
+  CHECK(busPublish(bus, parts, 2) == 0);
+}
+
+static void deliver(uint8_t const * data, uint32_t length, void * context) {
+  ReadLog * const log = context;
+
+  RecordHead head;
+  CHECK(length >= sizeof(head));
+  memcpy(&head, data, sizeof(head));
+  CHECK(head.producer < PRODUCERS);
+  CHECK(length == sizeof(head) + bodySize(head.producer, head.sequence));
+  for (uint32_t i = 0; i < length - sizeof(head); i++)
+    CHECK(data[sizeof(head) + i] == bodyByte(head.producer, head.sequence, i));
+
+  if (log->isStrict)
+    CHECK(head.sequence == log->expected[head.producer]);
+  else
+    CHECK(head.sequence >= log->expected[head.producer]);
+  log->expected[head.producer] = head.sequence + 1;
+  log->delivered++;
+}
+
+static void testWraparoundAndSlowReader(void) {
+  Bus bus;
+  CHECK(initBus(&bus, RING_SIZE, 2) == 0);
+  //The copy stands in for a forked process, it shares the mapping but keeps its own cursor
+  Bus slow = bus;
+  busAttach(&bus, 0);
+  busAttach(&slow, 1);
+
+  //Many laps of uneven records, so plenty of them run off the end of the ring and back to its start
+  ReadLog fast = { .isStrict = 1 };
+  for (uint32_t sequence = 0; sequence < 5000; sequence++) {
+    publishRecord(&bus, 0, sequence);
+    CHECK(busConsume(&bus, &fast, deliver) == 0);
+    CHECK(fast.delivered == sequence + 1);
+  }
+  CHECK(atomic_load(&(bus.header->reserved)) > 100 * bus.capacity);
+
+  //The slow reader is thousands of laps behind, it skips once and lands on the newest position
+  ReadLog lagging = { .isStrict = 0 };
+  CHECK(busConsume(&slow, &lagging, deliver) == 1);
+  CHECK(lagging.delivered == 0);
+  CHECK(slow.readCursor == atomic_load(&(bus.header->reserved)));
+
+  //From there on it sees everything again
+  lagging.isStrict = 1;
+  lagging.expected[0] = 5000;
+  for (uint32_t sequence = 5000; sequence < 5008; sequence++)
+    publishRecord(&bus, 0, sequence);
+  CHECK(busConsume(&slow, &lagging, deliver) == 0);
+  CHECK(lagging.delivered == 8);
+  CHECK(busConsume(&bus, &fast, deliver) == 0);
+  CHECK(fast.delivered == 5008);
+
+  //Less than a lap behind is no skip at all
+  for (uint32_t sequence = 5008; sequence < 5011; sequence++)
+    publishRecord(&bus, 0, sequence);
+  CHECK(busConsume(&slow, &lagging, deliver) == 0);
+  CHECK(lagging.delivered == 11);
+
+  uint8_t tooLarge[RING_SIZE / 4 + 1] = { 0 };
+  struct iovec const part = { .iov_base = tooLarge, .iov_len = sizeof(tooLarge) };
+  CHECK(busPublish(&bus, &part, 1) == -1);
+
+  free(slow.scratch);
+  freeBus(&bus);
+}
+
+typedef struct {
+  Bus bus;
+  uint32_t producer;
+} ProducerArgs;
+
+static atomic_uint producersDone;
+
+static void * produce(void * data) {
+  ProducerArgs * const args = data;
+  for (uint32_t sequence = 0; sequence < RECORDS_PER_PRODUCER; sequence++) {
+    publishRecord(&(args->bus), args->producer, sequence);
+    //Bursts with gaps, so the reader keeps up some of the time and gets lapped some of the time
+    if (sequence % 64 == 63)
+      sched_yield();
+  }
+  atomic_fetch_add(&producersDone, 1);
+  return NULL;
+}
+
+//Producers race each other and lap the reader, whatever does get delivered must be whole and in order
+static void testConcurrentProducers(void) {
+  Bus bus;
+  CHECK(initBus(&bus, RACING_RING_SIZE, 1) == 0);
+
+  ProducerArgs args[PRODUCERS];
+  pthread_t producers[PRODUCERS];
+  for (uint32_t i = 0; i < PRODUCERS; i++) {
+    args[i].bus = bus;
+    args[i].producer = i;
+  }
+  busAttach(&bus, 0);
+
+  atomic_store(&producersDone, 0);
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+    CHECK(pthread_create(&(producers[i]), NULL, produce, &(args[i])) == 0);
+
+  ReadLog log = { .isStrict = 0 };
+  uint64_t skips = 0;
+  while (atomic_load(&producersDone) < PRODUCERS)
+    skips += busConsume(&bus, &log, deliver);
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+    pthread_join(producers[i], NULL);
+  skips += busConsume(&bus, &log, deliver);
+  CHECK(bus.readCursor == atomic_load(&(bus.header->reserved)));
+  CHECK(skips > 0 || log.delivered == PRODUCERS * RECORDS_PER_PRODUCER);
+
+  //However the race went, the reader ends up caught up and takes the next record from everyone
+  uint64_t const raced = log.delivered;
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+    publishRecord(&bus, i, RECORDS_PER_PRODUCER);
+  CHECK(busConsume(&bus, &log, deliver) == 0);
+  CHECK(log.delivered == raced + PRODUCERS);
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+    CHECK(log.expected[i] == RECORDS_PER_PRODUCER + 1);
+
+  printf("bus: %lu of %u racing records delivered, %lu skips\n", (unsigned long)raced,
+    PRODUCERS * RECORDS_PER_PRODUCER, (unsigned long)skips);
+
+  freeBus(&bus);
+}
+
+int main(void) {
+  testWraparoundAndSlowReader();
+  testConcurrentProducers();
+  printf("bus: ok\n");
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Built from the source itself so lookups can go through findPath like the workers do
+#include "../src/ws.c"
+
+#include "test.h"
+
+#define READERS WS_MAX_THREADS
+#define SWAPS 20000
+
+static WSSocket socketInfo;
+static atomic_uint writerDone;
+static atomic_uint_fast64_t dynamicHits;
+
+static size_t stableMessage(WSConnection const * const client, char const * const incData, char ** const outData) {
+  (void)client; (void)incData; (void)outData; //unused
+  return 0;
+}
+
+static size_t dynamicMessage(WSConnection const * const client, char const * const incData, char ** const outData) {
+  (void)client; (void)incData; (void)outData; //unused
+  return 0;
+}
+
+static void stableBatch(WSConnection const * const client, WSMessageView const * const messages, uint32_t const count) {
+  (void)client; (void)messages; (void)count; //unused
+}
+
+static void noConnection(WSConnection const * const client) {
+  (void)client; //unused
+}
+
+//Looks paths up the way a worker does, holding a handler across a quiescent point only with a reference on it
+static void * readRoutes(void * data) {
+  uint32_t const reader = (uint32_t)(uintptr_t)data;
+  DStringView const stablePath = dstrviewof("/stable", 7);
+  DStringView const dynamicPath = dstrviewof("/dynamic", 8);
+  WSPathHandler * held = NULL;
+  uint64_t stableID = 0;
+
+  for (uint64_t round = 0; atomic_load(&writerDone) == 0; round++) {
+    epochQuiescent(&(socketInfo.routeEpochs), reader);
+
+    WSPathHandler * const stable = findPath(&socketInfo, stablePath);
+    CHECK(stable != NULL);
+    CHECK(stable->onMessage == stableMessage);
+    CHECK(stable->onMessageBatch == NULL || stable->onMessageBatch == stableBatch);
+    if (stableID == 0)
+      stableID = stable->routeID;
+    CHECK(stable->routeID == stableID);
+
+    WSPathHandler * const dynamic = findPath(&socketInfo, dynamicPath);
+    if (dynamic != NULL) {
+      CHECK(dynamic->onMessage == dynamicMessage);
+      CHECK(dynamic->routeID != stableID);
+      atomic_fetch_add(&dynamicHits, 1);
+    }
+
+    //Like a connection, keep one handler alive for a while after its table is gone
+    if (held != NULL && round % 16 == 0) {
+      CHECK(held->onMessage == stableMessage);
+      releasePathHandler(held);
+      held = NULL;
+    }
+    if (held == NULL) {
+      atomic_fetch_add(&(stable->references), 1);
+      held = stable;
+    }
+
+    //Blocked workers go offline, retirements must not wait for them
+    if (round % 64 == reader) {
+      epochOffline(&(socketInfo.routeEpochs), reader);
+      sched_yield();
+    }
+  }
+
+  epochOffline(&(socketInfo.routeEpochs), reader);
+  if (held != NULL)
+    releasePathHandler(held);
+  return NULL;
+}
+
+int main(void) {
+  CHECK(initSocket(&socketInfo) == 0);
+  CHECK(addValidPath(&socketInfo, "/stable", noConnection, noConnection, stableMessage) == 0);
+  CHECK(addValidPath(&socketInfo, "/stable", noConnection, noConnection, stableMessage) == -1);
+
+  pthread_t readers[READERS];
+  for (uint32_t i = 0; i < READERS; i++)
+    CHECK(pthread_create(&(readers[i]), NULL, readRoutes, (void *)(uintptr_t)i) == 0);
+
+  //Every swap retires the table the readers may still be walking
+  for (uint32_t i = 0; i < SWAPS; i++) {
+    CHECK(addValidPath(&socketInfo, "/dynamic", noConnection, noConnection, dynamicMessage) == 0);
+    CHECK(setPathBatchHandler(&socketInfo, "/stable", (i % 2) ? stableBatch : NULL) == 0);
+    CHECK(removeValidPath(&socketInfo, "/dynamic") == 0);
+  }
+  CHECK(removeValidPath(&socketInfo, "/dynamic") == -1);
+  atomic_store(&writerDone, 1);
+
+  for (uint32_t i = 0; i < READERS; i++)
+    pthread_join(readers[i], NULL);
+
+  //The last reader to go offline released everything that was retired
+  CHECK(atomic_load(&(socketInfo.routeEpochs.pending)) == 0);
+  CHECK(socketInfo.routeEpochs.retired == NULL);
+
+  //A reader still online holds the swapped out table back, going offline lets it go without another write
+  epochQuiescent(&(socketInfo.routeEpochs), 0);
+  CHECK(setPathBatchHandler(&socketInfo, "/stable", stableBatch) == 0);
+  CHECK(atomic_load(&(socketInfo.routeEpochs.pending)) == 1);
+  epochOffline(&(socketInfo.routeEpochs), 0);
+  CHECK(atomic_load(&(socketInfo.routeEpochs.pending)) == 0);
+
+  WSPathHandler * const stable = findPath(&socketInfo, dstrviewof("/stable", 7));
+  CHECK(stable != NULL && stable->onMessageBatch == stableBatch);
+  CHECK(atomic_load(&(stable->references)) == 1);
+  CHECK(findPath(&socketInfo, dstrviewof("/dynamic", 8)) == NULL);
+
+  printf("routes: %lu lookups found /dynamic during %u swaps\n", (unsigned long)atomic_load(&dynamicHits), SWAPS);
+  closeSocket(&socketInfo);
+  printf("routes: ok\n");
+  return 0;
+}
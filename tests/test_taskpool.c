@@ -0,0 +1,171 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "taskpool.h"
+#include "test.h"
+
+#define POOL_THREADS 4
+#define STRANDS 16
+#define TASKS_PER_STRAND 5000
+#define PRODUCERS 2
+
+//Owns its strand, the final task frees the whole thing the way a pooled connection does on disconnect
+typedef struct {
+  TaskStrand strand;
+  atomic_uint running; // Tasks of this strand inside run right now, must never pass 1
+  uint32_t nextSequence; // Only touched from the strand's own tasks
+} StrandState;
+
+typedef struct {
+  Task task;
+  StrandState * state;
+  uint32_t sequence;
+} SequencedTask;
+
+typedef struct {
+  Task task;
+  atomic_uint * counter;
+} CountingTask;
+
+static atomic_uint finalsRun;
+
+static void runSequenced(Task * task) {
+  SequencedTask * const sequenced = (SequencedTask *)((char *)task - offsetof(SequencedTask, task));
+  StrandState * const state = sequenced->state;
+
+  CHECK(atomic_fetch_add(&(state->running), 1) == 0);
+  CHECK(sequenced->sequence == state->nextSequence);
+  state->nextSequence++;
+  CHECK(atomic_fetch_sub(&(state->running), 1) == 1);
+
+  if (sequenced->task.isFinal) {
+    CHECK(state->nextSequence == TASKS_PER_STRAND + 1);
+    //Nothing may touch the strand after this, ASan catches it if anything does
+    freeTaskStrand(&(state->strand));
+    free(state);
+    atomic_fetch_add(&finalsRun, 1);
+  }
+  free(sequenced);
+}
+
+static void runCounting(Task * task) {
+  CountingTask * const counting = (CountingTask *)((char *)task - offsetof(CountingTask, task));
+  atomic_fetch_add(counting->counter, 1);
+  free(counting);
+}
+
+static void postSequenced(StrandState * state, uint32_t sequence, uint8_t isFinal) {
+  SequencedTask * const task = malloc(sizeof(SequencedTask));
+  CHECK(task != NULL);
+  memset(task, 0, sizeof(SequencedTask));
+  task->task.run = runSequenced;
+  task->task.isFinal = isFinal;
+  task->state = state;
+  task->sequence = sequence;
+  taskStrandPost(&(state->strand), &(task->task));
+}
+
+typedef struct {
+  StrandState ** states;
+  uint32_t first;
+  uint32_t count;
+} ProducerArgs;
+
+//Interleaves posts across its strands so several of them are in flight on the pool at once
+static void * produce(void * data) {
+  ProducerArgs * const args = data;
+
+  for (uint32_t sequence = 0; sequence <= TASKS_PER_STRAND; sequence++)
+    for (uint32_t i = args->first; i < args->first + args->count; i++)
+      postSequenced(args->states[i], sequence, sequence == TASKS_PER_STRAND);
+
+  return NULL;
+}
+
+static void testStrandOrdering(void) {
+  TaskPool pool;
+  CHECK(initTaskPool(&pool, POOL_THREADS) == 0);
+
+  StrandState * states[STRANDS];
+  for (uint32_t i = 0; i < STRANDS; i++) {
+    CHECK((states[i] = calloc(1, sizeof(StrandState))) != NULL);
+    CHECK(initTaskStrand(&(states[i]->strand), &pool) == 0);
+  }
+  CHECK(atomic_load(&(pool.reserved)) == STRANDS);
+
+  atomic_store(&finalsRun, 0);
+  pthread_t producers[PRODUCERS];
+  ProducerArgs args[PRODUCERS];
+  for (uint32_t i = 0; i < PRODUCERS; i++) {
+    args[i] = (ProducerArgs){ .states = states, .first = i * (STRANDS / PRODUCERS), .count = STRANDS / PRODUCERS };
+    CHECK(pthread_create(&(producers[i]), NULL, produce, &(args[i])) == 0);
+  }
+  for (uint32_t i = 0; i < PRODUCERS; i++)
+    pthread_join(producers[i], NULL);
+
+  stopTaskPool(&pool);
+  CHECK(atomic_load(&finalsRun) == STRANDS);
+  CHECK(atomic_load(&(pool.reserved)) == 0);
+  CHECK(atomic_load(&(pool.pending)) == 0);
+  freeTaskPool(&pool);
+}
+
+static void testStopDrains(void) {
+  TaskPool pool;
+  CHECK(initTaskPool(&pool, 2) == 0);
+
+  TaskStrand strand;
+  CHECK(initTaskStrand(&strand, &pool) == 0);
+
+  atomic_uint counter = 0;
+  for (uint32_t i = 0; i < 10000; i++) {
+    CountingTask * const task = calloc(1, sizeof(CountingTask));
+    CHECK(task != NULL);
+    task->task.run = runCounting;
+    task->counter = &counter;
+    if (i % 2 == 0)
+      CHECK(taskPoolSubmit(&pool, &(task->task)) == 0);
+    else
+      taskStrandPost(&strand, &(task->task));
+  }
+
+  //Stopping right away must still run everything that was queued
+  stopTaskPool(&pool);
+  CHECK(atomic_load(&counter) == 10000);
+
+  freeTaskStrand(&strand);
+  freeTaskPool(&pool);
+}
+
+static void testReservation(void) {
+  TaskPool pool;
+  CHECK(initTaskPool(&pool, 3) == 0);
+
+  TaskStrand * strands = calloc(300, sizeof(TaskStrand));
+  CHECK(strands != NULL);
+  for (uint32_t i = 0; i < 300; i++)
+    CHECK(initTaskStrand(&(strands[i]), &pool) == 0);
+
+  //Every queue must be able to take every strand's runner without growing
+  for (uint8_t i = 0; i < pool.threadCount; i++)
+    CHECK(pool.queues[i].capacity >= pool.queues[i].count + 300);
+
+  for (uint32_t i = 0; i < 300; i++)
+    freeTaskStrand(&(strands[i]));
+  CHECK(atomic_load(&(pool.reserved)) == 0);
+
+  free(strands);
+  freeTaskPool(&pool);
+}
+
+int main(void) {
+  testStrandOrdering();
+  testStopDrains();
+  testReservation();
+  printf("taskpool: ok\n");
+  return 0;
+}
@@ -0,0 +1,141 @@
+// Built from the source itself so the vector validators can be checked directly, not just the one the cpu picks
+#include "../src/utf8.c"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define MAX_PREFIX 80
+#define MAX_SUFFIX 40
+#define FUZZ_ROUNDS 200000
+
+static char const * const invalidSequences[] = {
+  "\x80", "\xBF", "\x80\x80", "\xC2\xA9\x80", // Stray continuations
+  "\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF", // Overlong
+  "\xED\xA0\x80", "\xED\xAF\xBF", "\xED\xB0\x80", "\xED\xBF\xBF", // Surrogates
+  "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xF7\xBF\xBF\xBF", // Past U+10FFFF
+  "\xF8\x88\x80\x80\x80", "\xFC\x84\x80\x80\x80\x80", "\xFE", "\xFF", // Never valid leads
+  "\xC2", "\xE1\x80", "\xF1\x80\x80", "\xF0\x9F\x98", // Truncated
+  "\xC2\x41", "\xE1\x80\x41", "\xF1\x80\x80\x41", "\xE1\xC2\xA9", // Interrupted
+  "\xF0\x9F\x98\x80\x80", "\xDF\xBF\xBF" // One continuation too many
+};
+
+static char const * const validSequences[] = {
+  "A", "\x7F", "\xC2\x80", "\xDF\xBF", "\xE0\xA0\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF",
+  "\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80"
+};
+
+static uint8_t hasSSE;
+static uint8_t hasAVX2;
+
+//Filler is valid on its own, either plain ASCII or three byte code points padded out with ASCII
+static void fill(uint8_t * data, size_t length, uint8_t isMultibyte) {
+  size_t i = 0;
+  if (isMultibyte)
+    for (; i + 3 <= length; i += 3)
+      memcpy(data + i, "\xE4\xB8\xAD", 3);
+  for (; i < length; i++)
+    data[i] = 'a' + i % 26;
+}
+
+static void checkAll(uint8_t const * data, size_t length, uint8_t expected) {
+  CHECK(utf8ValidateScalar(data, length) == expected);
+  CHECK(utf8Validate(data, length) == expected);
+#ifdef UTF8_HAS_X86
+  if (hasSSE)
+    CHECK(validateSSE(data, length) == expected);
+  if (hasAVX2)
+    CHECK(validateAVX2(data, length) == expected);
+#endif
+}
+
+static void checkStreamed(uint8_t const * data, size_t length, uint8_t expected) {
+  for (size_t split = 0; split <= length; split++) {
+    UTF8State state;
+    utf8Init(&state);
+    int8_t result = utf8Update(&state, data, split);
+    if (result == 0)
+      result = utf8Update(&state, data + split, length - split);
+    if (result == 0)
+      result = utf8Finish(&state);
+    CHECK((result == 0) == expected);
+  }
+}
+
+//Puts every sequence at every offset around the 16 and 32 byte block edges, with both kinds of filler around it
+static void testCorpus(char const * const * sequences, size_t count, uint8_t expected) {
+  for (size_t s = 0; s < count; s++) {
+    size_t const sequenceSize = strlen(sequences[s]);
+    for (uint8_t isMultibyte = 0; isMultibyte < 2; isMultibyte++) {
+      for (size_t prefix = 0; prefix <= MAX_PREFIX; prefix++) {
+        for (size_t suffix = 0; suffix <= MAX_SUFFIX; suffix += (suffix < 8) ? 1 : 7) {
+          size_t const length = prefix + sequenceSize + suffix;
+          // Exactly sized so ASan flags any read past the end
+          uint8_t * const data = malloc(length);
+          CHECK(data != NULL);
+          fill(data, prefix, isMultibyte);
+          memcpy(data + prefix, sequences[s], sequenceSize);
+          fill(data + prefix + sequenceSize, suffix, isMultibyte);
+
+          checkAll(data, length, expected);
+          if (prefix % 16 == 0 && suffix < 4)
+            checkStreamed(data, length, expected);
+          free(data);
+        }
+      }
+    }
+  }
+}
+
+static uint32_t nextRandom(uint64_t * seed) {
+  *seed = *seed * 6364136223846793005ull + 1442695040888963407ull;
+  return (uint32_t)(*seed >> 33);
+}
+
+//Random bytes drawn mostly from the interesting ranges, so a good share of the buffers come out valid
+static void testFuzz(void) {
+  static uint8_t const interesting[] = {
+    'a', 'z', 0x00, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1, 0xC2, 0xDF,
+    0xE0, 0xE1, 0xEC, 0xED, 0xEE, 0xEF, 0xF0, 0xF1, 0xF3, 0xF4, 0xF5, 0xFF
+  };
+  uint64_t seed = 0x5EEDu;
+  uint8_t buffer[160];
+  uint32_t validCount = 0;
+
+  for (uint32_t round = 0; round < FUZZ_ROUNDS; round++) {
+    size_t const length = 1 + nextRandom(&seed) % sizeof(buffer);
+    for (size_t i = 0; i < length; i++) {
+      uint32_t const pick = nextRandom(&seed);
+      buffer[i] = (pick & 1) ? 'a' + pick % 26 : interesting[(pick >> 1) % sizeof(interesting)];
+    }
+    //Splice in whole code points often enough that not every buffer fails in its first bytes
+    for (size_t i = 0; i + 4 <= length; i += 1 + nextRandom(&seed) % 24) {
+      char const * const sequence = validSequences[nextRandom(&seed) % (sizeof(validSequences) / sizeof(validSequences[0]))];
+      size_t const sequenceSize = strlen(sequence);
+      memcpy(buffer + i, sequence, sequenceSize);
+      i += sequenceSize;
+    }
+
+    uint8_t const expected = utf8ValidateScalar(buffer, length);
+    validCount += expected;
+    checkAll(buffer, length, expected);
+  }
+  printf("utf8: %u of %u random buffers valid\n", validCount, FUZZ_ROUNDS);
+}
+
+int main(void) {
+#ifdef UTF8_HAS_X86
+  __builtin_cpu_init();
+  hasSSE = __builtin_cpu_supports("sse4.1") != 0;
+  hasAVX2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+  printf("utf8: checking scalar%s%s\n", hasSSE ? ", SSE4.1" : "", hasAVX2 ? ", AVX2" : "");
+
+  testCorpus(invalidSequences, sizeof(invalidSequences) / sizeof(invalidSequences[0]), 0);
+  testCorpus(validSequences, sizeof(validSequences) / sizeof(validSequences[0]), 1);
+  testFuzz();
+
+  printf("utf8: ok\n");
+  return 0;
+}